@@ -1,12 +1,16 @@
 #ifndef BOARD_H
 #define BOARD_H
 
-#define MAX_MOVES 20
-#define MAX_LEVELS 20
 #define MAX_FILENAME 256
-#define MAX_GHOSTS 25
+
+#define CONTINUE_PLAY 0
+#define NEXT_LEVEL 1
+#define QUIT_GAME 2
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "log.h"
 
 typedef enum {
     REACHED_PORTAL = 1, // Pacman reached the portal
@@ -17,52 +21,118 @@ typedef enum {
 
 typedef struct {
     char command;   // Character representing the direction/action
-    int turns;      // Total turns this command lasts
-    int turns_left; // Turns remaining for this command
+    int turns;      // Times a move is repeated, or plays a 'T' waits
 } command_t;
 
+// Compiled .p/.m script, immutable once loaded and shared by every entity of the level that uses the file
+// Runs of the same command are stored once, so "D D D" is a single {'D', 3} and "T1000" a single wait
+typedef struct {
+    char* file;         // script the program was compiled from
+    int passo;          // PASSO of the script
+    int pos_x, pos_y;   // POS of the script, only meaningful when has_pos is set
+    int has_pos;        // whether the script has a POS line
+    int n_ops;          // number of instructions, 0 for a script without moves
+    command_t ops[];    // run-length encoded instructions, played in a loop
+} program_t;
+
 typedef struct {
     int pos_x, pos_y;            // current position
     int alive;                   // if is alive
     int points;                  // how many points have been collected
     int passo;                   // number of plays to wait before starting
-    command_t moves[MAX_MOVES];  // array of moves loaded from file
-    int current_move;            // Index of the current move in the moves array
-    int n_moves;                 // number of predefined moves, 0 if controlled by user, >0 if readed from level file
+    const program_t* program;    // compiled moves, NULL if controlled by user
+    int current_move;            // Index of the current instruction in the program
+    int current_repeat;          // Repetitions of the current instruction already played
     int waiting;                 // Turns left to wait before moving again
+    uint32_t rng;                // state of its random moves, advanced by every 'R' it plays
 } pacman_t;
 
 typedef struct {
     int pos_x, pos_y;           // current position
     int passo;                  // number of plays to wait between each move
-    command_t moves[MAX_MOVES]; // array of moves loaded from file
-    int n_moves;                // number of predefined moves from level file
-    int current_move;           // Index of the current move in the moves array
+    const program_t* program;   // compiled moves, NULL if the ghost stands still
+    int current_move;           // Index of the current instruction in the program
+    int current_repeat;         // Repetitions of the current instruction already played
     int waiting;                // Turns left to wait before moving again
     int charged;                // Flag indicating if the ghost is in 'charge' mode
+    uint32_t rng;               // state of its random moves, advanced by every 'R' it plays
 } ghost_t;
 
+// Occupancy word of a cell: OCC_EMPTY, a ghost id or a pacman id (flagged with OCC_PACMAN_FLAG)
+typedef uint16_t occupant_t;
+
+#define OCC_EMPTY 0
+#define OCC_PACMAN_FLAG 0x8000
+#define OCC_GHOST(index) ((occupant_t)((index) + 1))
+#define OCC_PACMAN(index) ((occupant_t)(OCC_PACMAN_FLAG | ((index) + 1)))
+#define OCC_IS_PACMAN(occ) (((occ) & OCC_PACMAN_FLAG) != 0)
+#define OCC_INDEX(occ) ((int)((occ) & ~OCC_PACMAN_FLAG) - 1)
+#define OCC_MAX_ENTITIES 0x7FFF // most pacmans or ghosts an occupancy word can tell apart
+
+// Packed into two bytes, cells are locked through the board's striped lock table
 typedef struct {
-    char content;          // stuff like 'P' for pacman 'M' for monster/ghost and 'W' for wall
-    int has_dot;           // whether there is a dot in this position or not
-    int has_portal;        // whether there is a portal in this position or not
-    pthread_mutex_t mutex; // mutex to lock this specific cell
+    char content;                 // stuff like 'P' for pacman 'M' for monster/ghost and 'W' for wall
+    unsigned char has_dot : 1;    // whether there is a dot in this position or not
+    unsigned char has_portal : 1; // whether there is a portal in this position or not
 } board_pos_t;
 
+#define PLANE_WALL 0
+#define PLANE_GHOST 1
+#define PLANE_PACMAN 2
+#define N_PLANES 3
+
+// Occupancy bitplanes with one bit per cell, kept both per row and per column so scans read consecutive bits
+typedef struct {
+    int row_words;            // 64-bit words per row, ceil(width / 64)
+    int col_words;            // 64-bit words per column, ceil(height / 64)
+    uint64_t* rows[N_PLANES]; // bit x of row y lives in rows[plane][y * row_words + x / 64]
+    uint64_t* cols[N_PLANES]; // bit y of column x lives in cols[plane][x * col_words + y / 64]
+} bitplanes_t;
+
+// Cells changed since the renderer last drew them, a bounded queue every mover can push to
+// A cell is queued at most once until it is drawn, so a ring as large as the board never overflows
+typedef struct {
+    uint32_t* ring;  // index + 1 of each queued cell, 0 for a slot that is reserved but not written yet
+    uint8_t* marks;  // 1 while a cell is queued
+    uint32_t mask;   // ring capacity - 1, a power of two
+    uint32_t head;   // next slot the renderer reads
+    uint32_t tail;   // next slot a mover reserves
+} dirty_cells_t;
+
 typedef struct {
     int width, height;                  // dimensions of the board
     board_pos_t* board;                 // actual board, a row-major matrix
+    size_t cells_mapped;                // bytes of 'board' mapped from a level cache, 0 when it is on the heap
+    pthread_mutex_t* locks;             // striped cell locks, cell i is guarded by locks[i & (n_locks - 1)]
+    int n_locks;                        // number of cell locks, a power of two sized by the number of entities
+    occupant_t* occupancy;              // per-cell occupancy index, the id of the entity standing on each cell
+    int lockfree;                       // Flag selecting compare-and-swap moves instead of the cell locks
+    bitplanes_t planes;                 // wall, ghost and pacman bitplanes used to resolve charged moves
+    dirty_cells_t dirty;                // cells to repaint, only tracked once enable_dirty_tracking was called
     int n_pacmans;                      // number of pacmans in the board
-    pacman_t* pacmans;                  // array containing every pacman in the board to iterate through when processing (Just 1)
+    pacman_t* pacmans;                  // array containing every pacman in the board, each one played by its own thread
     int n_ghosts;                       // number of ghosts in the board
     ghost_t* ghosts;                    // array containing every ghost in the board to iterate through when processing
     char level_name[256];               // name for the level file to keep track of which will be the next
     char pacman_file[256];              // file with pacman movements
-    char ghosts_files[MAX_GHOSTS][256]; // files with monster movements
+    char** pacmans_files;               // files with the movements of each pacman, NULL without a PAC line
+    char** ghosts_files;                // files with monster movements, one per ghost
+    program_t** programs;               // programs compiled for this level, one per distinct entity file
+    int n_programs;                     // number of compiled programs
     int tempo;                          // Duration of each play
     int save_active;                    // Flag indicating if a save game is active/requested
+    struct checkpoint* checkpoint;      // quick save the movers preserve each page into before writing it, NULL without one
+    struct history* history;            // rewind ring the movers record every change into, NULL when not recording
+    struct trace* trace;                // event trace the movers append every move to, NULL when not tracing
+    double load_ms;                     // Time spent parsing the level and its entity files
 } board_t;
 
+// A file mapped read-only into memory
+typedef struct {
+    const char* data; // first byte of the file, not NUL terminated
+    size_t size;      // length of the file in bytes
+} mapped_file_t;
+
 // Shared state structure to synchronize threads
 typedef struct {
     board_t *board;             // Pointer to the game board data
@@ -70,10 +140,19 @@ typedef struct {
     pthread_cond_t input_cond;  // Condition variable for input events
     int running;                // Flag indicating if the game loop is running
     int outcome;                // Result of the game (continue, next level, quit)
-    char pending_input;         // Input character waiting to be processed
     int save_request;           // Flag indicating a request to save the game
+    int rewind_request;         // Flag asking to rewind the last few seconds once the level threads stop
+    struct scheduler *scheduler; // Wakes each thread when its next play is due
+    struct frame_buffer *frames; // Frames published for the display thread
+    struct input_queue *input;   // Keys the input thread read for the pacman thread
 } game_state_t;
 
+// Arguments passed to each pacman thread
+typedef struct {
+    game_state_t *state; // Pointer to the shared game state
+    int pacman_index;    // Index of this pacman in the board's pacman array
+} pacman_thread_args_t;
+
 // Arguments passed to each ghost thread
 typedef struct {
     game_state_t *state; // Pointer to the shared game state
@@ -87,12 +166,58 @@ void sleep_ms(int milliseconds);
 /*Processes a command for Pacman or Ghost(Monster)
 *_index - corresponding index in board's pacman_t/ghost_t array
 command - command to be processed*/
-int move_pacman(board_t* board, int pacman_index, command_t* command);
-int move_ghost(board_t* board, int ghost_index, command_t* command);
+int move_pacman(board_t* board, int pacman_index, const command_t* command);
+int move_ghost(board_t* board, int ghost_index, const command_t* command);
+
+/*Plays the straight line move of a charged ghost: it runs in 'direction' up to the cell before the first wall or ghost,
+or onto the first pacman on the way*/
+int move_ghost_charged(board_t* board, int ghost_index, char direction);
+
+/*Moves a scripted entity past one play of its current instruction, wrapping around at the end of the program
+Does nothing for a NULL program*/
+void program_step(const program_t* program, int* current_move, int* current_repeat);
+
+/*Allocates a program for 'n_ops' instructions compiled from 'file' and registers it in the board, which frees it*/
+program_t* add_program(board_t* board, const char* file, int n_ops);
+
+/*Returns the program already compiled from 'file' for this board, NULL if there is none*/
+program_t* find_program(board_t* board, const char* file);
+
+/*Builds the lock table, occupancy index and bitplanes once the cells and entities are loaded*/
+void prepare_board(board_t* board);
+
+/*Seeds the random moves of every pacman and ghost, each entity draws from its own sequence
+so the directions an entity picks do not depend on how the threads interleave*/
+void seed_random_moves(board_t* board, unsigned int seed);
+
+/*Switches a loaded board to lock-free moves, where a cell is claimed with a compare-and-swap on its occupancy word
+The occupancy index itself is built by the loaders and kept up to date by every move*/
+void enable_lockfree_moves(board_t* board);
+
+/*Recomputes the occupancy index and entity bitplanes of 'count' cells from 'first' after their content was overwritten
+The cells are left without occupants and queued for repainting, place_entities puts the entities back*/
+void resync_cells(board_t* board, int first, int count);
+
+/*Registers every entity in the occupancy index of the cell it stands on, when that cell shows it and has no occupant yet*/
+void place_entities(board_t* board);
+
+/*Starts queueing every cell a move changes, for renderers that only repaint what changed
+Every cell is queued once to begin with*/
+void enable_dirty_tracking(board_t* board);
+
+/*Takes the next changed cell off the queue, -1 when there is none
+Only one thread may drain the queue*/
+int next_dirty_cell(board_t* board);
 
 /*Process the death of a Pacman*/
 void kill_pacman(board_t* board, int pacman_index);
 
+/*Returns how many pacmans are still alive, a level is lost once none is*/
+int pacmans_alive(board_t* board);
+
+/*Returns the points of every pacman of the level added up*/
+int pacmans_points(board_t* board);
+
 /*Adds a pacman to the board*/
 int load_pacman(board_t* board, int points);
 
@@ -108,33 +233,30 @@ int load_level_filename(board_t *board, const char *filename, int accumulated_po
 /*Unloads levels loaded by load_level*/
 void unload_level(board_t * board);
 
-/*Reads the full content of a file into a buffer*/
-char* read_file_content(const char* filename);
+/*Maps the whole content of a file read-only into memory, returns 0 on success*/
+int map_file(const char* filename, mapped_file_t* file);
 
-// DEBUG FILE
-
-/*Opens the debug file*/
-void open_debug_file(char *filename);
+/*Releases a file mapped by map_file*/
+void unmap_file(mapped_file_t* file);
 
-/*Closes the debug file*/
-void close_debug_file();
-
-/*Writes to the open debug file*/
-void debug(const char * format, ...);
+// DEBUG FILE
 
-/*Writes the board and its contents to the open debug file*/
+/*Writes the board and its contents to the open debug file, however large it is
+Waits for room in the log instead of dropping rows, so movers must not call it*/
 void print_board(board_t* board);
 
 /*Checks if coordinates are within bounds and valid for placing an entity*/
 int is_valid_pos(board_t *board, int x, int y);
 
-/*Parses a move string from a file into a command struct*/
-int parse_move_line(char *linha, command_t *moves_array, int *n_moves);
+/*Parses a move line of 'len' chars (not NUL terminated) from a file into a command struct
+A command equal to the last one only extends it, so the array is run-length encoded
+The array grows as needed, 'capacity' holds its allocated length*/
+int parse_move_line(const char *linha, size_t len, command_t **moves_array, int *n_moves, int *capacity);
 
 /*Loads entity data (pacman/ghost) from a specific file*/
 int load_entity_file(board_t *board, const char* filename, int index, int is_pacman, int points);
 
-/*Processes the entity list string from the level file*/
-void processar_entidades(board_t *board, char *linha, int tipo, int points);
+/*Processes the entity list line of 'len' chars from the level file*/
+void process_entities(board_t *board, const char *linha, size_t len, int tipo, int points);
 
 #endif
\ No newline at end of file
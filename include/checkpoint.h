@@ -0,0 +1,66 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "board.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Cells per checkpoint page, a page is copied the first time one of its cells is written after the checkpoint
+#define CHECKPOINT_PAGE_CELLS 64
+
+#define PAGE_UNTOUCHED 0
+#define PAGE_COPYING 1
+#define PAGE_SAVED 2
+
+// In-memory quick save of a level: the entities are copied when it is taken, the cells only as they change
+typedef struct checkpoint {
+    int level;              // position of the level in the level list
+    int width, height;      // dimensions of the board it was taken from
+    int n_pages;            // pages covering the board
+    uint8_t* page_state;    // PAGE_UNTOUCHED, PAGE_COPYING or PAGE_SAVED for each page
+    board_pos_t* cells;     // content of the board when the checkpoint was taken, valid for saved pages only
+    int* saved;             // pages saved so far, in the order they were first written
+    int n_saved;            // number of entries in 'saved'
+    int n_pacmans;          // number of pacmans copied
+    pacman_t* pacmans;      // pacmans when the checkpoint was taken
+    int n_ghosts;           // number of ghosts copied
+    ghost_t* ghosts;        // ghosts when the checkpoint was taken
+    int detached;           // every page is saved and the board no longer reports its writes
+} checkpoint_t;
+
+/*Takes a checkpoint of a level no thread is playing, 'level' is its position in the level list
+From now on the board saves each page into the checkpoint before the page is first written*/
+void checkpoint_take(checkpoint_t* ckpt, board_t* board, int level);
+
+/*Copies the page of cell 'index' into the checkpoint unless it was already saved
+Called by the movers before they write a cell, safe to call from any number of threads*/
+void checkpoint_save_page(checkpoint_t* ckpt, board_t* board, int index);
+
+/*Saves every page not saved yet and stops following the board, called before the board is unloaded*/
+void checkpoint_detach(checkpoint_t* ckpt, board_t* board);
+
+/*Puts a board no thread is playing back in the state it had when the checkpoint was taken
+A detached checkpoint is restored into the same level freshly loaded, the board stops following the checkpoint
+Returns 0 on success*/
+int checkpoint_restore(checkpoint_t* ckpt, board_t* board);
+
+/*Stops following the board, if any, and frees the checkpoint*/
+void checkpoint_free(checkpoint_t* ckpt, board_t* board);
+
+/*Writes the whole state of a board no thread is playing to a snapshot file, 'level' is its position in the level list
+The file is replaced in one step, so a crash never leaves half a snapshot; returns 0 on success*/
+int checkpoint_write(board_t* board, int level, const char* filename);
+
+/*Writes the same snapshot to an open stream, for files that hold snapshots among other records
+Returns 0 on success*/
+int checkpoint_write_stream(board_t* board, int level, FILE* out);
+
+/*Reads one snapshot written by checkpoint_write_stream from an open stream into a detached checkpoint
+Returns 0 on success*/
+int checkpoint_read_stream(checkpoint_t* ckpt, FILE* in, char level_name[MAX_FILENAME]);
+
+/*Reads a snapshot file into a detached checkpoint, restored with checkpoint_restore into its level freshly loaded
+'level_name' receives the file name of that level, returns 0 on success*/
+int checkpoint_read(checkpoint_t* ckpt, const char* filename, char level_name[MAX_FILENAME]);
+
+#endif
@@ -2,6 +2,7 @@
 #define DISPLAY_H
 
 #include "board.h"
+#include "frame.h"
 #include <ncurses.h>
 
 
@@ -20,6 +21,12 @@ int terminal_init();
 /*Draw the board on the screen*/
 void draw_board(board_t* board, int mode);
 
+/*Draw a published frame, repainting only the cells that differ from the last frame drawn*/
+void draw_frame(const frame_t* frame, const char* level_name);
+
+/*Makes the next draw_frame compare every cell, called before the first frame of a level*/
+void forget_frames();
+
 /*Add a specific character with colour i into position (pos_x,pos_y) of the creen
 Pre loaded colours:
 1- Yellow
@@ -35,9 +42,6 @@ void draw(char c, int colour_i, int pos_x, int pos_y);
 /*Call ncurses refresh() to update the screen*/
 void refresh_screen();
 
-/*Ncurses will be reading the player's inputs*/
-char get_input();
-
 void terminal_cleanup();
 
 #endif
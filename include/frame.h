@@ -0,0 +1,63 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "board.h"
+#include <pthread.h>
+
+// Glyph of a charged ghost, every other cell uses its content char or '@', '.' and ' ' for empty cells
+#define GLYPH_CHARGED_GHOST 'm'
+
+// Score of one pacman as a frame shows it
+typedef struct {
+    int points;             // points the pacman collected
+    int alive;              // whether it is still playing
+} pacman_score_t;
+
+// Immutable picture of the board published for the renderer
+typedef struct {
+    unsigned long seq;      // publication number, consecutive frames differ by one
+    int width, height;      // dimensions of the board
+    unsigned char* glyphs;  // one glyph per cell, row-major
+    int* changed;           // cells whose glyph differs from frame seq - 1
+    int n_changed;          // number of entries in 'changed'
+    int points;             // points of every pacman added up
+    int n_pacmans;          // entries in 'scores'
+    pacman_score_t* scores; // score of each pacman
+    int mode;               // what the status line shows, one of the DRAW_* modes
+    int last;               // Flag marking the final frame of the level
+} frame_t;
+
+// Triple buffer of frames: the publisher fills one, the reader holds another and the third is the latest published
+// Neither side ever waits for the other to finish with a frame
+typedef struct frame_buffer {
+    frame_t frames[3];      // the three buffers
+    int back;               // buffer the publisher fills, owned by the publisher
+    int published;          // buffer of the latest frame the publisher released, owned by the publisher
+    int front;              // buffer the reader holds, owned by the reader
+    int latest;             // buffer swapped between both sides, FRAME_FRESH set while the reader has not taken it
+    unsigned long seq;      // number of the last published frame
+    pthread_mutex_t mutex;  // Only used to sleep the reader until a frame is published
+    pthread_cond_t cond;    // Signalled on each publication
+} frame_buffer_t;
+
+/*Glyph shown for a cell of the board*/
+unsigned char cell_glyph(board_t* board, int index);
+
+/*Fills one score per pacman of the board into 'scores' and returns their points added up*/
+int pacman_scores(board_t* board, pacman_score_t* scores);
+
+/*Allocates the three frames for a board and publishes its first complete frame*/
+void frame_init(frame_buffer_t* fb, board_t* board, int mode);
+
+/*Publishes a frame with every cell the moves queued since the last one, never blocks on the reader
+'last' marks the final frame of the level*/
+void frame_publish(frame_buffer_t* fb, board_t* board, int mode, int last);
+
+/*Takes the newest published frame, waiting up to 'timeout_ms' for one the reader has not seen yet
+Returns NULL on timeout; the frame stays valid until the next call*/
+const frame_t* frame_acquire(frame_buffer_t* fb, int timeout_ms);
+
+/*Frees the frames*/
+void frame_destroy(frame_buffer_t* fb);
+
+#endif
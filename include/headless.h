@@ -0,0 +1,36 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "board.h"
+
+// Options of a headless run
+typedef struct {
+    long max_ticks;    // tick budget of each level
+    unsigned int seed; // seed for the random moves
+    int lockfree;      // use compare-and-swap moves instead of the cell locks
+    int batch;         // games played by run_batch, 0 for a single headless game
+} headless_options_t;
+
+// Result of running one level without a terminal
+typedef struct {
+    long ticks;  // number of plays simulated
+    int outcome; // CONTINUE_PLAY if the tick budget ran out, NEXT_LEVEL or QUIT_GAME otherwise
+    int points;  // points of every pacman added up when the level stopped
+} level_result_t;
+
+/*Advances every pacman and then every ghost by exactly one play
+Returns CONTINUE_PLAY, NEXT_LEVEL or QUIT_GAME*/
+int headless_tick(board_t *board);
+
+/*Runs a loaded level in lockstep, with no sleeps, until it ends or 'max_ticks' plays have passed*/
+int headless_run_level(board_t *board, long max_ticks, level_result_t *result);
+
+/*Plays every level in 'lista' headlessly and prints a ticks/second report to stdout*/
+int run_headless(char lista[][MAX_FILENAME], int n_levels, const headless_options_t *options);
+
+/*Plays 'options->batch' independent headless games of the level list, spread over one thread per core
+Game g seeds its random moves as a single game run with seed 'options->seed + g * n_levels' would, so any game
+can be played again on its own. Prints the win rate, ticks to the portal and death cells of each level to stdout*/
+int run_batch(char lista[][MAX_FILENAME], int n_levels, const headless_options_t *options);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "board.h"
+#include <stdint.h>
+
+// Records kept by default, a power of two; a quiet level keeps more ticks of history than a busy one
+#define HISTORY_RECORDS 65536
+
+#define HISTORY_CELL 1
+#define HISTORY_PACMAN 2
+#define HISTORY_GHOST 3
+
+// State of a pacman or ghost before a change, its program never changes
+typedef struct {
+    int32_t pos_x, pos_y;
+    int32_t alive;
+    int32_t points;
+    int32_t current_move;
+    int32_t current_repeat;
+    int32_t waiting;
+    int32_t charged;
+    uint32_t rng;
+} history_entity_t;
+
+// What a cell or an entity held right before one change
+typedef struct {
+    unsigned long tick;           // tick the change happened in
+    int32_t kind;                 // HISTORY_CELL, HISTORY_PACMAN or HISTORY_GHOST
+    int32_t index;                // cell index, or index of the pacman or ghost
+    union {
+        board_pos_t cell;         // old content of the cell
+        history_entity_t entity;  // old state of the entity
+    } old;
+} history_record_t;
+
+// Bounded ring of undo records, each mover appends the old value of whatever it is about to change
+// Once full, the oldest records are overwritten and the earliest tick that can be reached moves forward
+typedef struct history {
+    history_record_t* records;  // the ring
+    unsigned long mask;         // ring capacity - 1
+    unsigned long head;         // number of records ever appended, the next one goes to head & mask
+    unsigned long tick;         // current tick, advanced by history_tick
+} history_t;
+
+/*Allocates an empty history of 'capacity' records, rounded up to a power of two*/
+void history_init(history_t* history, unsigned long capacity);
+
+/*Starts the next tick, called once per play while the level runs*/
+void history_tick(history_t* history);
+
+/*Records the content of cell 'index' before it is written, safe to call from any number of threads*/
+void history_record_cell(history_t* history, const board_t* board, int index);
+
+/*Records the state of a pacman or ghost before it changes, 'kind' is HISTORY_PACMAN or HISTORY_GHOST*/
+void history_record_entity(history_t* history, const board_t* board, int kind, int index);
+
+/*Undoes every change of the last 'ticks' ticks on a board no thread is playing, or as many as the ring still holds
+Returns the number of ticks actually undone*/
+unsigned long history_rewind(history_t* history, board_t* board, unsigned long ticks);
+
+/*Forgets every record, used once the board was put back in a state the records do not lead to*/
+void history_clear(history_t* history);
+
+/*Frees the ring*/
+void history_free(history_t* history);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <time.h>
+
+// Keys the player can queue ahead of the pacman, a power of two; keys typed beyond that are dropped
+#define INPUT_RING_SIZE 32
+
+// A key and the moment it was read from the terminal
+typedef struct {
+    char key;              // one of W, A, S, D, Q, G or U
+    struct timespec at;    // monotonic time it was read
+} keypress_t;
+
+// Single-producer single-consumer ring between the input thread and the pacman thread
+typedef struct input_queue {
+    keypress_t ring[INPUT_RING_SIZE];
+    unsigned int head;     // next key the consumer takes, written by the consumer only
+    unsigned int tail;     // next free slot, written by the producer only
+    int wake[2];           // pipe whose read end makes the input thread's poll() return on stop
+    int escape;            // position inside a terminal escape sequence, producer only
+    long dropped;          // keys lost to a full ring, producer only
+    long n_moves;          // keys played, consumer only
+    double total_ms;       // sum of their key-to-move latencies, consumer only
+    double max_ms;         // worst key-to-move latency, consumer only
+} input_queue_t;
+
+/*Creates an empty queue and its wake-up pipe, returns 0 on success*/
+int input_init(input_queue_t* queue);
+
+/*Blocks in poll() until 'fd' has bytes, the queue is stopped or 'timeout_ms' passed (-1 waits for ever)
+Queues every game key read and returns how many, -1 once the queue is stopped*/
+int input_read_keys(input_queue_t* queue, int fd, int timeout_ms);
+
+/*Takes the oldest queued key, returns 1 if there was one*/
+int input_pop(input_queue_t* queue, keypress_t* key);
+
+/*Records how long a key took from the terminal to the end of its move*/
+void input_played(input_queue_t* queue, const keypress_t* key);
+
+/*Makes input_read_keys return -1 from now on, safe to call from any thread*/
+void input_stop(input_queue_t* queue);
+
+/*Closes the wake-up pipe*/
+void input_destroy(input_queue_t* queue);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef LEVEL_CACHE_H
+#define LEVEL_CACHE_H
+
+#include "board.h"
+
+// Suffix appended to a level file name to get its binary cache
+#define LEVEL_CACHE_SUFFIX ".bin"
+
+/*Loads a level through its binary cache ("<filename>.bin")
+The cache is used while the level and every entity file it names keep their mtime and size,
+otherwise the text files are parsed and the cache is written again*/
+int load_level_cached(board_t *board, const char *filename, int points);
+
+/*Writes the binary cache of a level that was just loaded from 'filename' and has not been played yet*/
+int write_level_cache(board_t *board, const char *filename);
+
+#endif
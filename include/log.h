@@ -0,0 +1,43 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+// Most detailed level compiled in, calls above it cost nothing (make LOG_LEVEL=1 keeps errors and warnings)
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+// Bytes of log each thread can have waiting for the writer, a power of two; messages beyond that are dropped
+#define LOG_RING_BYTES (64 * 1024)
+
+/*Opens the debug file and starts the thread that writes the log to it*/
+void open_debug_file(char *filename);
+
+/*Writes everything still queued, stops the writer thread and closes the debug file*/
+void close_debug_file();
+
+/*Queues a formatted message on the calling thread's log ring, never blocks
+The message is dropped, and counted, when the ring is full*/
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/*Queues 'len' bytes as they are, waiting for the writer to make room when 'wait' is set instead of dropping them
+Only threads that may block should wait*/
+void log_append(const char *text, size_t len, int wait);
+
+// A level above LOG_LEVEL still type-checks its arguments but compiles to nothing
+#define LOG_AT(level, ...) do { if ((level) <= LOG_LEVEL) log_write((level), __VA_ARGS__); } while (0)
+
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+
+/*Writes to the open debug file at LOG_DEBUG*/
+#define debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+
+#endif
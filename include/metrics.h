@@ -0,0 +1,63 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// Latency histograms, every value is in nanoseconds
+#define HIST_MOVE_PACMAN 0   // duration of move_pacman
+#define HIST_MOVE_GHOST 1    // duration of move_ghost
+#define HIST_LOCK_WAIT 2     // time lock_two_positions waited for its cell locks, 0 when they were free
+#define HIST_STATE_HOLD 3    // time the render thread held state->mutex
+#define HIST_FRAME 4         // time the render thread took to publish a frame
+#define HIST_INPUT_LATENCY 5 // time from a key arriving to the move it asked for being played
+#define N_HISTOGRAMS 6
+
+// Event counters
+#define COUNTER_MOVES 0      // moves played
+#define COUNTER_LOCKS 1      // cell lock pairs taken
+#define COUNTER_CONTENDED 2  // cell lock pairs that had to wait
+#define COUNTER_FRAMES 3     // frames published
+#define N_COUNTERS 4
+
+// Set to 0 (make METRICS=0) to compile every measurement out, nothing is dumped then
+#ifndef METRICS
+#define METRICS 1
+#endif
+
+// Sub-buckets per power of two, values are kept with 1/16 relative precision
+#define HIST_SUB_BITS 4
+
+#if METRICS
+
+/*Starts the thread that writes every counter and histogram to 'filename' whenever SIGUSR1 arrives
+Blocks SIGUSR1 in the calling thread, so it must run before any other thread is created to keep them from taking it
+Returns 0 on success*/
+int metrics_start(const char *filename);
+
+/*Writes the stats file one last time and stops the thread started by metrics_start*/
+void metrics_stop(void);
+
+/*Names the calling thread in the stats file*/
+void metrics_name_thread(const char *name);
+
+/*Monotonic clock in nanoseconds*/
+uint64_t metrics_now(void);
+
+/*Adds a value to one of the calling thread's histograms, never blocks*/
+void metrics_record(int histogram, uint64_t ns);
+
+/*Adds to one of the calling thread's counters, never blocks*/
+void metrics_count(int counter, uint64_t n);
+
+#else
+
+static inline int metrics_start(const char *filename) { (void)filename; return 0; }
+static inline void metrics_stop(void) {}
+static inline void metrics_name_thread(const char *name) { (void)name; }
+static inline uint64_t metrics_now(void) { return 0; }
+static inline void metrics_record(int histogram, uint64_t ns) { (void)histogram; (void)ns; }
+static inline void metrics_count(int counter, uint64_t n) { (void)counter; (void)n; }
+
+#endif
+
+#endif
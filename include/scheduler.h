@@ -0,0 +1,48 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include <time.h>
+
+// Slots of the timer wheel, a power of two; entries further away than one turn wait for their round
+#define SCHED_WHEEL_SLOTS 256
+
+// A thread that sleeps on the scheduler, one per renderer, pacman and ghost
+typedef struct sched_entry {
+    struct sched_entry* next; // next entry hashed to the same slot
+    unsigned long due;        // tick the entry is due at
+    int fired;                // the due tick was reached and the owner has not woken up yet
+    pthread_cond_t cond;      // wakes the owner
+} sched_entry_t;
+
+// Timer wheel counting plays of 'tempo' milliseconds, a single timer thread wakes each entry when it is due
+typedef struct scheduler {
+    pthread_mutex_t mutex;                    // Protects every field below
+    pthread_cond_t timer_cond;                // wakes the timer thread when an earlier tick is scheduled or on stop
+    sched_entry_t* slots[SCHED_WHEEL_SLOTS];  // entry due at tick t lives in slots[t % SCHED_WHEEL_SLOTS]
+    sched_entry_t* entries;                   // one entry per sleeping thread
+    int n_entries;                            // number of entries
+    int n_scheduled;                          // entries currently in the wheel
+    unsigned long now;                        // last tick the timer reached
+    unsigned long target;                     // tick the timer thread sleeps until, 0 when it sleeps with no deadline
+    struct timespec epoch;                    // time of tick 0 on the monotonic clock
+    int tempo;                                // duration of each play in milliseconds
+    int stopped;                              // Flag releasing every sleeper for good
+    pthread_t tid;                            // timer thread
+} scheduler_t;
+
+/*Creates a scheduler with 'n_entries' sleepers and starts its timer thread, tick 0 is now*/
+void sched_init(scheduler_t* sched, int tempo, int n_entries);
+
+/*Puts 'entry' to sleep until 'plays' ticks after the current one, 0 returns at once
+Returns 0 once the entry is due, 1 if the scheduler was stopped
+When stopped and 'left' is not NULL, stores in it the plays the entry still had to sleep*/
+int sched_sleep(scheduler_t* sched, int entry, long plays, long* left);
+
+/*Releases every current and future sleeper*/
+void sched_stop(scheduler_t* sched);
+
+/*Stops the scheduler, joins its timer thread and frees it*/
+void sched_destroy(scheduler_t* sched);
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "board.h"
+#include "checkpoint.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+
+#define TRACE_PACMAN 1
+#define TRACE_GHOST 2
+#define TRACE_TICK 3
+
+// One decision as stored in the trace file, in the order the moves became visible to each other
+typedef struct {
+    uint8_t kind;     // TRACE_PACMAN, TRACE_GHOST or TRACE_TICK
+    char command;     // command the entity was given: its script instruction, the key pressed or 'R'
+    char played;      // direction it took, the draw for an 'R'; 0 for a play spent waiting
+    int8_t result;    // move_t the move returned
+    int32_t index;    // index of the pacman or ghost
+} trace_record_t;
+
+// A record with the order number it was given while the level ran
+typedef struct {
+    uint64_t order;
+    trace_record_t record;
+} trace_event_t;
+
+// Events of one entity, or of the render thread's ticks, appended by the single thread that plays it
+typedef struct {
+    trace_event_t* events;
+    size_t n_events;
+    size_t capacity;
+} trace_lane_t;
+
+// Binary trace of a session, one segment per stretch of play between two stops of the level threads
+// Each segment holds the board it started from, every move in order, and the board it ended with
+typedef struct trace {
+    FILE* file;               // trace file, NULL for a trace that only collects events
+    uint64_t order;           // order numbers handed out so far
+    trace_lane_t* lanes;      // the ticks, then one lane per pacman, then one per ghost
+    int n_lanes;              // lanes of the current segment
+    int n_pacmans;            // pacmans of the current segment
+    int level;                // level of the current segment
+    unsigned long segments;   // segments written
+    unsigned long events;     // events written
+} trace_t;
+
+// Header at the start of a trace file
+typedef struct {
+    char magic[8];            // TRACE_MAGIC
+    uint32_t version;         // TRACE_VERSION
+    uint32_t record_size;     // sizeof(trace_record_t) when the trace was written
+    int32_t lockfree;         // the session used lock-free moves
+    char level_dir[PATH_MAX]; // absolute path of the level directory
+} trace_header_t;
+
+// A segment read back from a trace file
+typedef struct {
+    int level;                    // position of the level in the level list
+    char level_name[MAX_FILENAME];// file name of the level
+    checkpoint_t start;           // board when the segment started
+    checkpoint_t end;             // board when the segment ended
+    uint64_t n_records;           // moves and ticks in between
+    trace_record_t* records;
+} trace_segment_t;
+
+/*Creates the trace file and writes its header, returns 0 on success*/
+int trace_open(trace_t* trace, const char* filename, const char* level_dir, int lockfree);
+
+/*Starts a segment on a board no thread is playing: writes the board as it is and attaches the trace to it
+With no file open, the trace only collects the events of the board*/
+int trace_begin(trace_t* trace, board_t* board, int level);
+
+/*Hands out the next order number, safe to call from any number of threads*/
+uint64_t trace_order(trace_t* trace);
+
+/*Appends a move to the lane of its entity, only the thread playing that entity may call it*/
+void trace_move(trace_t* trace, uint64_t order, int kind, int index, char command, char played, int result);
+
+/*Appends the start of a new tick, only the render thread calls it*/
+void trace_tick(trace_t* trace);
+
+/*Ends the segment once the level threads stopped: writes every event in order and the board as it ended
+Detaches the trace from the board, returns 0 on success*/
+int trace_end(trace_t* trace, board_t* board);
+
+/*Takes the last event of an entity's lane back out, used to compare a replayed move with the trace
+Returns 0 when the lane had one*/
+int trace_take(trace_t* trace, int kind, int index, trace_record_t* record);
+
+/*Flushes and closes the trace file*/
+void trace_close(trace_t* trace);
+
+/*Reads and checks the header of a trace file, returns 0 on success*/
+int trace_read_header(FILE* in, trace_header_t* header);
+
+/*Reads the next segment of a trace file
+Returns 0 on success, 1 at the end of the trace and -1 for a truncated or damaged segment*/
+int trace_read_segment(FILE* in, trace_segment_t* segment);
+
+/*Frees a segment read by trace_read_segment*/
+void trace_free_segment(trace_segment_t* segment);
+
+#endif
@@ -0,0 +1,326 @@
+#include "board.h"
+#include "display.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Board sides and ghost counts measured, a ghost count that does not fit a board is skipped
+static const int bench_sizes[] = { 30, 128, 512, 1024, 4096 };
+static const int bench_ghosts[] = { 4, 64, 512 };
+#define N_SIZES ((int)(sizeof(bench_sizes) / sizeof(bench_sizes[0])))
+#define N_GHOST_COUNTS ((int)(sizeof(bench_ghosts) / sizeof(bench_ghosts[0])))
+
+#define DEFAULT_BUDGET_MS 200
+#define MIN_BATCHES 3
+#define PACMAN_BATCH 1024   // pacman moves timed together
+#define GHOST_ROUNDS 2      // moves of every ghost timed together, there and back
+
+// Timings of one function on one board
+typedef struct {
+    unsigned long batches;  // batches timed
+    unsigned long ops;      // calls over every batch
+    uint64_t total_ns;      // time spent in them
+    double best;            // fastest batch, in nanoseconds per call
+} bench_result_t;
+
+// What the benchmark runs, from the command line
+typedef struct {
+    int budget_ms;   // least time spent timing each function on each board
+    int max_size;    // largest board side measured
+} bench_options_t;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void add_batch(bench_result_t *result, unsigned long ops, uint64_t ns) {
+    double per_op = ops ? (double)ns / ops : 0.0;
+    if (result->batches == 0 || per_op < result->best) result->best = per_op;
+    result->batches++;
+    result->ops += ops;
+    result->total_ns += ns;
+}
+
+// Batches stop once the budget is spent and a few were timed, however slow each one is
+static int keep_timing(const bench_result_t *result, const bench_options_t *options) {
+    return result->batches < MIN_BATCHES || result->total_ns < (uint64_t)options->budget_ms * 1000000ull;
+}
+
+// Rows the ghosts are spread over: every other row, leaving the first one to the pacman
+static int ghost_rows(int side) {
+    return (side - 3) / 2;
+}
+
+// Length of the stretch of row each ghost gets, the stretches of a row are split by a wall
+static int ghost_spacing(int side, int n_ghosts) {
+    int rows = ghost_rows(side);
+    if (rows <= 0) return 0;
+    int per_row = (n_ghosts + rows - 1) / rows;
+    return (side - 2) / per_row;
+}
+
+// Each ghost starts at the left end of its own stretch, so every charge runs the whole stretch and back
+static void ghost_position(int side, int n_ghosts, int g, int *x, int *y) {
+    int rows = ghost_rows(side);
+    *y = 2 + 2 * (g % rows);
+    *x = 1 + ghost_spacing(side, n_ghosts) * (g / rows);
+}
+
+// A ghost needs at least two free cells between the walls to step back and forth
+static int ghosts_fit(int side, int n_ghosts) {
+    return ghost_spacing(side, n_ghosts) >= 3;
+}
+
+// Writes a square level with walls around an open field of dots and its ghost scripts, returns 0 on success
+// The pacman takes the first free cell of the first row, the portal sits in the opposite corner
+// Walls split the ghost rows into one stretch per ghost, ghosts never meet each other or the pacman
+static int write_level(const char *filename, int side, int n_ghosts) {
+    int spacing = ghost_spacing(side, n_ghosts);
+    for (int g = 0; g < n_ghosts; g++) {
+        char script[MAX_FILENAME];
+        snprintf(script, sizeof(script), "%d.m", g);
+        FILE *out = fopen(script, "w");
+        if (!out) return 1;
+        int x, y;
+        ghost_position(side, n_ghosts, g, &x, &y);
+        fprintf(out, "PASSO 0\nPOS %d %d\nD\nA\n", y, x);
+        if (fclose(out) != 0) return 1;
+    }
+
+    FILE *out = fopen(filename, "w");
+    if (!out) return 1;
+    fprintf(out, "DIM %d %d\nTEMPO 10\nMON", side, side);
+    for (int g = 0; g < n_ghosts; g++) fprintf(out, " %d.m", g);
+    fputc('\n', out);
+
+    char *linha = malloc(side + 1);
+    if (!linha) {
+        fclose(out);
+        return 1;
+    }
+    linha[side] = '\n';
+    for (int y = 0; y < side; y++) {
+        for (int x = 0; x < side; x++) {
+            int border = y == 0 || x == 0 || y == side - 1 || x == side - 1;
+            linha[x] = border ? 'X' : 'o';
+        }
+        if (y >= 2 && y % 2 == 0 && y / 2 <= ghost_rows(side)) {
+            for (int x = spacing; x < side - 1; x += spacing) linha[x] = 'X';
+        }
+        if (y == side - 2) linha[side - 2] = '@';
+        fwrite(linha, 1, side + 1, out);
+    }
+    free(linha);
+    return fclose(out) != 0;
+}
+
+static void remove_level(const char *filename, int n_ghosts) {
+    unlink(filename);
+    for (int g = 0; g < n_ghosts; g++) {
+        char script[MAX_FILENAME];
+        snprintf(script, sizeof(script), "%d.m", g);
+        unlink(script);
+    }
+}
+
+static void bench_load(const char *filename, const bench_options_t *options, bench_result_t *result) {
+    while (keep_timing(result, options)) {
+        board_t board = {0};
+        uint64_t start = now_ns();
+        int failed = load_level_filename(&board, filename, 0);
+        uint64_t ns = now_ns() - start;
+        if (failed) return;
+        unload_level(&board);
+        add_batch(result, 1, ns);
+    }
+}
+
+// The pacman walks back and forth along the first row, where no ghost ever goes
+static void bench_move_pacman(board_t *board, const bench_options_t *options, bench_result_t *result) {
+    command_t right = { .command = 'D', .turns = 1 };
+    command_t left = { .command = 'A', .turns = 1 };
+
+    while (keep_timing(result, options)) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < PACMAN_BATCH; i++) {
+            move_pacman(board, 0, (i & 1) ? &left : &right);
+            board->pacmans[0].waiting = 0;
+        }
+        add_batch(result, PACMAN_BATCH, now_ns() - start);
+    }
+}
+
+// Every ghost steps right and then back left, as the live game it never has a wait left when it plays
+static void bench_move_ghost(board_t *board, const bench_options_t *options, bench_result_t *result) {
+    command_t right = { .command = 'D', .turns = 1 };
+    command_t left = { .command = 'A', .turns = 1 };
+
+    while (keep_timing(result, options)) {
+        uint64_t start = now_ns();
+        for (int round = 0; round < GHOST_ROUNDS; round++) {
+            for (int g = 0; g < board->n_ghosts; g++) {
+                move_ghost(board, g, (round & 1) ? &left : &right);
+                board->ghosts[g].waiting = 0;
+            }
+        }
+        add_batch(result, (unsigned long)GHOST_ROUNDS * board->n_ghosts, now_ns() - start);
+    }
+}
+
+// Every ghost charges to the wall at the end of its stretch and back, each charge scans the row bitplanes
+static void bench_move_ghost_charged(board_t *board, const bench_options_t *options, bench_result_t *result) {
+    while (keep_timing(result, options)) {
+        uint64_t start = now_ns();
+        for (int round = 0; round < GHOST_ROUNDS; round++) {
+            for (int g = 0; g < board->n_ghosts; g++) {
+                move_ghost_charged(board, g, (round & 1) ? 'A' : 'D');
+            }
+        }
+        add_batch(result, (unsigned long)GHOST_ROUNDS * board->n_ghosts, now_ns() - start);
+    }
+}
+
+// Only the drawing into the curses window is timed, nothing is ever sent to the terminal
+static void bench_draw_board(board_t *board, const bench_options_t *options, bench_result_t *result) {
+    resizeterm(board->height + 5, board->width);
+    while (keep_timing(result, options)) {
+        uint64_t start = now_ns();
+        draw_board(board, DRAW_MENU);
+        add_batch(result, 1, now_ns() - start);
+    }
+    resizeterm(24, 80);
+}
+
+// Opens a curses screen that writes to /dev/null, so draw_board runs exactly as in the game without a terminal
+static SCREEN *open_offscreen(void) {
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    if (!out || !in) {
+        if (out) fclose(out);
+        if (in) fclose(in);
+        return NULL;
+    }
+
+    const char *term = getenv("TERM");
+    SCREEN *screen = newterm(term && term[0] && strcmp(term, "dumb") != 0 ? term : "xterm", out, in);
+    if (!screen) screen = newterm("vt100", out, in);
+    if (!screen) return NULL;
+
+    if (has_colors()) start_color();
+    return screen;
+}
+
+static void print_result(const char *name, const bench_result_t *result, int last) {
+    if (result->batches == 0) {
+        printf("        \"%s\": null%s\n", name, last ? "" : ",");
+        return;
+    }
+    printf("        \"%s\": {\"batches\": %lu, \"calls\": %lu, \"total_ns\": %llu, \"ns_per_call\": %.1f, "
+           "\"best_ns_per_call\": %.1f}%s\n", name, result->batches, result->ops,
+           (unsigned long long)result->total_ns, (double)result->total_ns / result->ops, result->best,
+           last ? "" : ",");
+}
+
+// Generates one level, times every function on it and prints its JSON object, returns 0 on success
+static int bench_case(int side, int n_ghosts, int draw, const bench_options_t *options, int first) {
+    char filename[MAX_FILENAME];
+    snprintf(filename, sizeof(filename), "%dx%d.lvl", side, side);
+    if (write_level(filename, side, n_ghosts) != 0) {
+        remove_level(filename, n_ghosts);
+        return 1;
+    }
+
+    bench_result_t load = {0}, pacman = {0}, ghost = {0}, charged = {0}, drawn = {0};
+    bench_load(filename, options, &load);
+
+    board_t board = {0};
+    if (load_level_filename(&board, filename, 0) != 0) {
+        remove_level(filename, n_ghosts);
+        return 1;
+    }
+    snprintf(board.level_name, sizeof(board.level_name), "%s", filename);
+
+    bench_move_pacman(&board, options, &pacman);
+    bench_move_ghost(&board, options, &ghost);
+    bench_move_ghost_charged(&board, options, &charged);
+    if (draw) bench_draw_board(&board, options, &drawn);
+
+    unload_level(&board);
+    remove_level(filename, n_ghosts);
+
+    printf("%s    {\n", first ? "" : ",\n");
+    printf("      \"width\": %d, \"height\": %d, \"ghosts\": %d,\n", side, side, n_ghosts);
+    printf("      \"results\": {\n");
+    print_result("load_level_filename", &load, 0);
+    print_result("move_pacman", &pacman, 0);
+    print_result("move_ghost", &ghost, 0);
+    print_result("move_ghost_charged", &charged, 0);
+    print_result("draw_board", &drawn, 1);
+    printf("      }\n    }");
+    fflush(stdout);
+    return 0;
+}
+
+static int parse_options(int argc, char **argv, bench_options_t *options) {
+    options->budget_ms = DEFAULT_BUDGET_MS;
+    options->max_size = bench_sizes[N_SIZES - 1];
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            options->budget_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            options->max_size = atoi(argv[++i]);
+        } else {
+            return 1;
+        }
+    }
+    return options->budget_ms < 0;
+}
+
+int main(int argc, char **argv) {
+    bench_options_t options;
+    if (parse_options(argc, argv, &options) != 0) {
+        fprintf(stderr, "Usage: %s [--budget milliseconds] [--max-size side]\n", argv[0]);
+        return 2;
+    }
+
+    // The levels are generated in a directory of their own and removed as soon as they were measured
+    char dir[] = "/tmp/pacbench.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        perror("Error creating the level directory");
+        return 2;
+    }
+
+    SCREEN *screen = open_offscreen();
+    if (!screen) fprintf(stderr, "Warning: no curses terminal description found, draw_board is not timed\n");
+
+    printf("{\n  \"budget_ms\": %d, \"metrics\": %d, \"log_level\": %d,\n", options.budget_ms, METRICS, LOG_LEVEL);
+    printf("  \"boards\": [\n");
+
+    int failed = 0, first = 1;
+    for (int s = 0; s < N_SIZES && bench_sizes[s] <= options.max_size; s++) {
+        for (int c = 0; c < N_GHOST_COUNTS; c++) {
+            if (!ghosts_fit(bench_sizes[s], bench_ghosts[c])) continue;
+            if (bench_case(bench_sizes[s], bench_ghosts[c], screen != NULL, &options, first) != 0) {
+                fprintf(stderr, "Error: could not measure the %dx%d board with %d ghosts\n", bench_sizes[s],
+                        bench_sizes[s], bench_ghosts[c]);
+                failed = 1;
+                continue;
+            }
+            first = 0;
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    if (screen) {
+        endwin();
+        delscreen(screen);
+    }
+    if (chdir("/") == 0) rmdir(dir);
+    return failed;
+}
@@ -1,49 +1,162 @@
 #include "board.h"
+#include "checkpoint.h"
+#include "history.h"
+#include "trace.h"
+#include "metrics.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
-#include <stdarg.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-FILE * debugfile;
+#define LOCKS_PER_ENTITY 4
+#define MIN_CELL_LOCKS 16
+#define MAX_CELL_LOCKS 4096
+
+// Returns the stripe of the lock table that guards a board position
+static inline int lock_stripe(board_t* board, int idx) {
+    return idx & (board->n_locks - 1);
+}
+
+// Order number of the move the calling thread is playing, for the trace
+static _Thread_local uint64_t move_order;
+static _Thread_local int move_ordered;
+
+// Numbers the move being played in the trace the moment its effect becomes visible to other threads
+// Only the first call of a move counts, so a move that saw another one is always ordered after it
+static inline void order_move(board_t* board) {
+    if (!board->trace || move_ordered) return;
+    move_order = trace_order(board->trace);
+    move_ordered = 1;
+}
+
+// Takes a cell lock, adding to 'waited' how long it had to wait for it when another thread held it
+// A free lock is taken without reading the clock
+static void lock_counting_wait(pthread_mutex_t* lock, uint64_t* waited, int* contended) {
+    if (pthread_mutex_trylock(lock) == 0) return;
+
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(lock);
+    *waited += metrics_now() - start;
+    *contended = 1;
+}
 
 // Locks two board positions in a specific order to avoid deadlocks
 static void lock_two_positions(board_t* board, int idx1, int idx2) {
-    if (idx1 == idx2) {
-        pthread_mutex_lock(&board->board[idx1].mutex);
-        return;
-    }
+    int stripe1 = lock_stripe(board, idx1);
+    int stripe2 = lock_stripe(board, idx2);
+    uint64_t waited = 0;
+    int contended = 0;
 
-    int first = (idx1 < idx2) ? idx1 : idx2;
-    int second = (idx1 < idx2) ? idx2 : idx1;
+    if (stripe1 == stripe2) {
+        lock_counting_wait(&board->locks[stripe1], &waited, &contended);
+    } else {
+        int first = (stripe1 < stripe2) ? stripe1 : stripe2;
+        int second = (stripe1 < stripe2) ? stripe2 : stripe1;
 
-    pthread_mutex_lock(&board->board[first].mutex);
-    pthread_mutex_lock(&board->board[second].mutex);
+        lock_counting_wait(&board->locks[first], &waited, &contended);
+        lock_counting_wait(&board->locks[second], &waited, &contended);
+    }
+
+    metrics_count(COUNTER_LOCKS, 1);
+    if (contended) metrics_count(COUNTER_CONTENDED, 1);
+    metrics_record(HIST_LOCK_WAIT, waited);
 }
 
 // Unlocks two previously locked board positions
 static void unlock_two_positions(board_t* board, int idx1, int idx2) {
-    pthread_mutex_unlock(&board->board[idx1].mutex);
-    if (idx1 != idx2) {
-        pthread_mutex_unlock(&board->board[idx2].mutex);
+    order_move(board);
+    int stripe1 = lock_stripe(board, idx1);
+    int stripe2 = lock_stripe(board, idx2);
+
+    pthread_mutex_unlock(&board->locks[stripe1]);
+    if (stripe1 != stripe2) {
+        pthread_mutex_unlock(&board->locks[stripe2]);
+    }
+}
+
+// Allocates the striped lock table, sized by how many entities can move at once
+static void init_cell_locks(board_t* board) {
+    int wanted = (board->n_pacmans + board->n_ghosts) * LOCKS_PER_ENTITY;
+    int n_locks = MIN_CELL_LOCKS;
+    while (n_locks < wanted && n_locks < MAX_CELL_LOCKS) {
+        n_locks *= 2;
+    }
+
+    board->n_locks = n_locks;
+    board->locks = malloc(n_locks * sizeof(pthread_mutex_t));
+    for (int i = 0; i < n_locks; i++) {
+        pthread_mutex_init(&board->locks[i], NULL);
     }
 }
 
-// Checks if a Pacman exists at the given coordinates and kills it if found
-static int find_and_kill_pacman(board_t* board, int new_x, int new_y) {
+// Lets the active quick save copy the page of a cell and the rewind ring record the cell before it is written
+static inline void preserve_cell(board_t* board, int idx) {
+    if (board->checkpoint) checkpoint_save_page(board->checkpoint, board, idx);
+    if (board->history) history_record_cell(board->history, board, idx);
+}
+
+// Records the state of a pacman or ghost in the rewind ring before it changes
+static inline void preserve_entity(board_t* board, int kind, int index) {
+    if (board->history) history_record_entity(board->history, board, kind, index);
+}
+
+// Checks the occupancy index for a Pacman at the given position and kills it if found
+static int find_and_kill_pacman(board_t* board, int index) {
+    occupant_t occ = board->occupancy[index];
+    if (!OCC_IS_PACMAN(occ)) return VALID_MOVE;
+
+    int p = OCC_INDEX(occ);
+    if (!board->pacmans[p].alive) return VALID_MOVE;
+
+    preserve_entity(board, HISTORY_PACMAN, p);
+    order_move(board);
+    board->pacmans[p].alive = 0;
+    kill_pacman(board, p);
+    return DEAD_PACMAN;
+}
+
+// Appends a move that was just played to the trace, numbered now when nothing it did was seen by other threads
+static void trace_played(board_t* board, int kind, int index, const command_t* command, char played, int result) {
+    order_move(board);
+    move_ordered = 0;
+    trace_move(board->trace, move_order, kind, index, command->command, played, result);
+}
+
+// Next direction of an entity's random walk, a xorshift step of its own state
+static char random_direction(uint32_t* rng) {
+    static const char directions[] = {'W', 'S', 'A', 'D'};
+    uint32_t x = *rng ? *rng : 0x9E3779B9u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rng = x;
+    return directions[x >> 30];
+}
+
+// Mixes the seed with the entity, so every pacman and ghost walks its own sequence
+static uint32_t entity_seed(unsigned int seed, int kind, int index) {
+    uint64_t z = ((uint64_t)seed << 32) ^ ((uint64_t)kind << 24) ^ (uint64_t)index;
+    z += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return (uint32_t)z ? (uint32_t)z : 1;
+}
+
+void seed_random_moves(board_t* board, unsigned int seed) {
     for (int p = 0; p < board->n_pacmans; p++) {
-        pacman_t* pac = &board->pacmans[p];
-        if (pac->pos_x == new_x && pac->pos_y == new_y && pac->alive) {
-            pac->alive = 0;
-            kill_pacman(board, p);
-            return DEAD_PACMAN;
-        }
+        board->pacmans[p].rng = entity_seed(seed, TRACE_PACMAN, p);
+    }
+    for (int g = 0; g < board->n_ghosts; g++) {
+        board->ghosts[g].rng = entity_seed(seed, TRACE_GHOST, g);
     }
-    return VALID_MOVE;
 }
 
 // Helper function to calculate the 1D array index from 2D coordinates
@@ -56,7 +169,97 @@ static inline int is_valid_position(board_t* board, int x, int y) {
     return (x >= 0 && x < board->width) && (y >= 0 && y < board->height);
 }
 
-// Finds the first position on the board that is not a wall or a portal
+// Sets or clears the bit of cell (x, y) in both the row and the column copy of a plane
+static void plane_update(board_t* board, int plane, int x, int y, int set) {
+    bitplanes_t* planes = &board->planes;
+    uint64_t* row_word = &planes->rows[plane][y * planes->row_words + (x >> 6)];
+    uint64_t* col_word = &planes->cols[plane][x * planes->col_words + (y >> 6)];
+    uint64_t row_bit = 1ULL << (x & 63);
+    uint64_t col_bit = 1ULL << (y & 63);
+
+    // Neighbouring cells share words but not cell locks, so the updates have to be atomic
+    if (set) {
+        __atomic_fetch_or(row_word, row_bit, __ATOMIC_RELAXED);
+        __atomic_fetch_or(col_word, col_bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(row_word, ~row_bit, __ATOMIC_RELAXED);
+        __atomic_fetch_and(col_word, ~col_bit, __ATOMIC_RELAXED);
+    }
+}
+
+// Reads the bit at position 'pos' of a line (row or column) of a plane
+static inline int line_test(const uint64_t* line, int pos) {
+    return (__atomic_load_n(&line[pos >> 6], __ATOMIC_RELAXED) >> (pos & 63)) & 1;
+}
+
+// Union of every plane for one word of a line
+static inline uint64_t line_obstacles(uint64_t* const lines[N_PLANES], int offset) {
+    return __atomic_load_n(&lines[PLANE_WALL][offset], __ATOMIC_RELAXED) |
+           __atomic_load_n(&lines[PLANE_GHOST][offset], __ATOMIC_RELAXED) |
+           __atomic_load_n(&lines[PLANE_PACMAN][offset], __ATOMIC_RELAXED);
+}
+
+// Finds the first occupied position at or after 'from' on a line, -1 if there is none
+static int line_scan_forward(uint64_t* const lines[N_PLANES], int base, int n_words, int from) {
+    int word = from >> 6;
+    uint64_t keep = ~0ULL << (from & 63);
+
+    for (; word < n_words; word++) {
+        uint64_t bits = line_obstacles(lines, base + word) & keep;
+        if (bits) return (word << 6) + __builtin_ctzll(bits);
+        keep = ~0ULL;
+    }
+    return -1;
+}
+
+// Finds the last occupied position at or before 'from' on a line, -1 if there is none
+static int line_scan_backward(uint64_t* const lines[N_PLANES], int base, int from) {
+    if (from < 0) return -1;
+
+    int word = from >> 6;
+    uint64_t keep = ~0ULL >> (63 - (from & 63));
+
+    for (; word >= 0; word--) {
+        uint64_t bits = line_obstacles(lines, base + word) & keep;
+        if (bits) return (word << 6) + 63 - __builtin_clzll(bits);
+        keep = ~0ULL;
+    }
+    return -1;
+}
+
+// Queues a changed cell for the renderer, unless it is already waiting to be drawn
+static void mark_dirty(board_t* board, int idx) {
+    dirty_cells_t* dirty = &board->dirty;
+    if (!dirty->ring) return;
+    if (__atomic_exchange_n(&dirty->marks[idx], 1, __ATOMIC_ACQ_REL)) return;
+
+    uint32_t slot = __atomic_fetch_add(&dirty->tail, 1, __ATOMIC_ACQ_REL) & dirty->mask;
+    __atomic_store_n(&dirty->ring[slot], (uint32_t)idx + 1, __ATOMIC_RELEASE);
+}
+
+// Writes the content char and the entity bitplanes of a cell for its new occupant
+static void set_cell_mirrors(board_t* board, int idx, occupant_t occ) {
+    int x = idx % board->width;
+    int y = idx / board->width;
+    char content = ' ';
+
+    preserve_cell(board, idx);
+
+    if (occ != OCC_EMPTY) content = OCC_IS_PACMAN(occ) ? 'P' : 'M';
+    __atomic_store_n(&board->board[idx].content, content, __ATOMIC_RELAXED);
+
+    plane_update(board, PLANE_GHOST, x, y, content == 'M');
+    plane_update(board, PLANE_PACMAN, x, y, content == 'P');
+    mark_dirty(board, idx);
+}
+
+// Puts an entity (or nobody) on a cell, keeping the content, the occupancy index and the bitplanes in step
+static void set_cell_occupant(board_t* board, int idx, occupant_t occ) {
+    board->occupancy[idx] = occ;
+    set_cell_mirrors(board, idx, occ);
+}
+
+// Finds the first position on the board that is not a wall, a portal or taken by another entity
 static void find_first_free_pos(board_t* board, int* x, int* y) {
     for (int row = 0; row < board->height; row++) {
         for (int col = 0; col < board->width; col++) {
@@ -64,7 +267,7 @@ static void find_first_free_pos(board_t* board, int* x, int* y) {
             char content = board->board[index].content;
             int is_portal = board->board[index].has_portal;
 
-            if (content != 'W' && !is_portal) {
+            if (content != 'W' && content != 'P' && content != 'M' && !is_portal) {
                 *x = col;
                 *y = row;
                 return;
@@ -81,12 +284,291 @@ void sleep_ms(int milliseconds) {
     nanosleep(&ts, NULL);
 }
 
+// Atomically reads the occupancy word of a cell
+static inline occupant_t occ_load(board_t* board, int idx) {
+    return __atomic_load_n(&board->occupancy[idx], __ATOMIC_ACQUIRE);
+}
+
+// Replaces the occupancy word of a cell only if it still holds 'expected'
+static inline int occ_cas(board_t* board, int idx, occupant_t expected, occupant_t desired) {
+    return __atomic_compare_exchange_n(&board->occupancy[idx], &expected, desired, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Refreshes the content char and bitplanes of a cell from its occupancy word, walls are never claimed
+// Another mover may claim or leave the cell between the read and the stores, so the word is read again
+// afterwards and the mirrors rewritten until they were written from the word the cell still holds
+static void sync_content(board_t* board, int idx) {
+    occupant_t occ = occ_load(board, idx);
+    while (1) {
+        set_cell_mirrors(board, idx, occ);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        occupant_t now = occ_load(board, idx);
+        if (now == occ) return;
+        occ = now;
+    }
+}
+
+// Turns lock-free moves on, the occupancy words are already maintained by the loaders
+void enable_lockfree_moves(board_t* board) {
+    board->lockfree = 1;
+}
+
+// Allocates the dirty queue with every cell already in it
+void enable_dirty_tracking(board_t* board) {
+    dirty_cells_t* dirty = &board->dirty;
+    uint32_t n_cells = (uint32_t)board->width * board->height;
+    uint32_t capacity = 1;
+    while (capacity < n_cells) capacity <<= 1;
+
+    dirty->ring = calloc(capacity, sizeof(uint32_t));
+    dirty->marks = calloc(n_cells, sizeof(uint8_t));
+    dirty->mask = capacity - 1;
+    dirty->head = 0;
+    dirty->tail = 0;
+
+    // The first frame paints every cell
+    for (uint32_t idx = 0; idx < n_cells; idx++) {
+        mark_dirty(board, idx);
+    }
+}
+
+// Pops the oldest queued cell, the mark is cleared before the cell is drawn so a later change queues it again
+int next_dirty_cell(board_t* board) {
+    dirty_cells_t* dirty = &board->dirty;
+    if (!dirty->ring) return -1;
+    if (dirty->head == __atomic_load_n(&dirty->tail, __ATOMIC_ACQUIRE)) return -1;
+
+    uint32_t* slot = &dirty->ring[dirty->head & dirty->mask];
+    uint32_t entry;
+    // The mover that reserved this slot may not have written it yet, it is only a few instructions behind
+    do {
+        entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    } while (entry == 0);
+    __atomic_store_n(slot, 0, __ATOMIC_RELAXED);
+    dirty->head++;
+
+    int idx = (int)entry - 1;
+    __atomic_store_n(&dirty->marks[idx], 0, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+// Allocates the bitplanes and fills the wall plane, entities are added by build_occupancy
+static void build_bitplanes(board_t* board) {
+    bitplanes_t* planes = &board->planes;
+    planes->row_words = (board->width + 63) / 64;
+    planes->col_words = (board->height + 63) / 64;
+
+    for (int plane = 0; plane < N_PLANES; plane++) {
+        planes->rows[plane] = calloc((size_t)board->height * planes->row_words, sizeof(uint64_t));
+        planes->cols[plane] = calloc((size_t)board->width * planes->col_words, sizeof(uint64_t));
+    }
+
+    for (int y = 0; y < board->height; y++) {
+        for (int x = 0; x < board->width; x++) {
+            if (board->board[get_board_index(board, x, y)].content == 'W')
+                plane_update(board, PLANE_WALL, x, y, 1);
+        }
+    }
+}
+
+// Fills the occupancy index and the entity bitplanes from the entities placed by the loader
+static void build_occupancy(board_t* board) {
+    int n_cells = board->width * board->height;
+    board->occupancy = calloc(n_cells, sizeof(occupant_t));
+    build_bitplanes(board);
+    place_entities(board);
+}
+
+// Empties the occupancy words of a range of cells and sets their entity bits from the content
+void resync_cells(board_t* board, int first, int count) {
+    for (int idx = first; idx < first + count; idx++) {
+        char content = board->board[idx].content;
+        int x = idx % board->width;
+        int y = idx / board->width;
+
+        board->occupancy[idx] = OCC_EMPTY;
+        plane_update(board, PLANE_GHOST, x, y, content == 'M');
+        plane_update(board, PLANE_PACMAN, x, y, content == 'P');
+        mark_dirty(board, idx);
+    }
+}
+
+// Claims the cell of each pacman and ghost in the occupancy index, only where the content shows that kind of entity
+void place_entities(board_t* board) {
+    for (int p = 0; p < board->n_pacmans; p++) {
+        pacman_t* pac = &board->pacmans[p];
+        if (!is_valid_position(board, pac->pos_x, pac->pos_y)) continue;
+        int idx = get_board_index(board, pac->pos_x, pac->pos_y);
+        if (board->board[idx].content == 'P' && board->occupancy[idx] == OCC_EMPTY)
+            set_cell_occupant(board, idx, OCC_PACMAN(p));
+    }
+    for (int g = 0; g < board->n_ghosts; g++) {
+        ghost_t* ghost = &board->ghosts[g];
+        if (!is_valid_position(board, ghost->pos_x, ghost->pos_y)) continue;
+        int idx = get_board_index(board, ghost->pos_x, ghost->pos_y);
+        if (board->board[idx].content == 'M' && board->occupancy[idx] == OCC_EMPTY)
+            set_cell_occupant(board, idx, OCC_GHOST(g));
+    }
+}
+
+// Builds everything derived from the cells and entities once a level has been loaded
+void prepare_board(board_t* board) {
+    init_cell_locks(board);
+    build_occupancy(board);
+}
+
+// Lock-free version of a pacman step: claims the destination, then releases the source
+// A failed release means a ghost took the source cell in the meantime and the pacman is dead
+static int step_pacman_lockfree(board_t* board, int pacman_index, int old_index, int new_index) {
+    pacman_t* pac = &board->pacmans[pacman_index];
+    occupant_t self = OCC_PACMAN(pacman_index);
+
+    if (board->board[new_index].content == 'W') {
+        return INVALID_MOVE;
+    }
+
+    order_move(board);
+    if (board->board[new_index].has_portal) {
+        if (!occ_cas(board, old_index, self, OCC_EMPTY)) return DEAD_PACMAN;
+        sync_content(board, old_index);
+        preserve_cell(board, new_index);
+        __atomic_store_n(&board->board[new_index].content, 'P', __ATOMIC_RELAXED);
+        mark_dirty(board, new_index);
+        return REACHED_PORTAL;
+    }
+
+    while (1) {
+        occupant_t target = occ_load(board, new_index);
+
+        if (target == OCC_EMPTY) {
+            if (occ_cas(board, new_index, OCC_EMPTY, self)) break;
+            continue;
+        }
+        if (OCC_IS_PACMAN(target)) {
+            return INVALID_MOVE;
+        }
+
+        // Walked into a ghost
+        debug("Killing %d pacman\n\n", pacman_index);
+        order_move(board);
+        if (occ_cas(board, old_index, self, OCC_EMPTY)) sync_content(board, old_index);
+        __atomic_store_n(&pac->alive, 0, __ATOMIC_RELEASE);
+        return DEAD_PACMAN;
+    }
+
+    if (!occ_cas(board, old_index, self, OCC_EMPTY)) {
+        // Caught on the way out, give the destination back
+        if (occ_cas(board, new_index, self, OCC_EMPTY)) sync_content(board, new_index);
+        return DEAD_PACMAN;
+    }
+    sync_content(board, old_index);
+
+    if (board->board[new_index].has_dot) {
+        pac->points++;
+        preserve_cell(board, new_index);
+        board->board[new_index].has_dot = 0;
+    }
+    pac->pos_x = new_index % board->width;
+    pac->pos_y = new_index / board->width;
+    sync_content(board, new_index);
+
+    return __atomic_load_n(&pac->alive, __ATOMIC_ACQUIRE) ? VALID_MOVE : DEAD_PACMAN;
+}
+
+// Lock-free version of a ghost step, a ghost may only claim an empty cell or one holding a pacman
+static int step_ghost_lockfree(board_t* board, int ghost_index, int old_index, int new_index) {
+    ghost_t* ghost = &board->ghosts[ghost_index];
+    occupant_t self = OCC_GHOST(ghost_index);
+    int result = VALID_MOVE;
+
+    if (board->board[new_index].content == 'W') {
+        return INVALID_MOVE;
+    }
+
+    order_move(board);
+    while (1) {
+        occupant_t target = occ_load(board, new_index);
+
+        if (target == OCC_EMPTY) {
+            if (occ_cas(board, new_index, OCC_EMPTY, self)) break;
+            continue;
+        }
+        if (!OCC_IS_PACMAN(target)) {
+            return INVALID_MOVE;
+        }
+        if (occ_cas(board, new_index, target, self)) {
+            int pacman_index = OCC_INDEX(target);
+            debug("Killing %d pacman\n\n", pacman_index);
+            preserve_entity(board, HISTORY_PACMAN, pacman_index);
+            __atomic_store_n(&board->pacmans[pacman_index].alive, 0, __ATOMIC_RELEASE);
+            result = DEAD_PACMAN;
+            break;
+        }
+    }
+
+    if (occ_cas(board, old_index, self, OCC_EMPTY)) sync_content(board, old_index);
+    ghost->pos_x = new_index % board->width;
+    ghost->pos_y = new_index / board->width;
+    sync_content(board, new_index);
+
+    return result;
+}
+
+// While tracing, a lock-free step holds the stripe locks of its two cells, the order number it takes is then
+// the order in which it won its compare-and-swaps against every other move touching those cells
+// Without the locks a mover could be numbered first and still lose the race for a cell, and replay would diverge
+static int move_pacman_lockfree(board_t* board, int pacman_index, int old_index, int new_index) {
+    if (!board->trace) return step_pacman_lockfree(board, pacman_index, old_index, new_index);
+
+    lock_two_positions(board, old_index, new_index);
+    int result = step_pacman_lockfree(board, pacman_index, old_index, new_index);
+    unlock_two_positions(board, old_index, new_index);
+    return result;
+}
+
+static int move_ghost_lockfree(board_t* board, int ghost_index, int old_index, int new_index) {
+    if (!board->trace) return step_ghost_lockfree(board, ghost_index, old_index, new_index);
+
+    lock_two_positions(board, old_index, new_index);
+    int result = step_ghost_lockfree(board, ghost_index, old_index, new_index);
+    unlock_two_positions(board, old_index, new_index);
+    return result;
+}
+
+// Moves a scripted entity past one play of its current instruction
+void program_step(const program_t* program, int* current_move, int* current_repeat) {
+    if (!program) return;
+    if (++*current_repeat < program->ops[*current_move].turns) return;
+
+    *current_repeat = 0;
+    if (++*current_move == program->n_ops) *current_move = 0;
+}
+
+// Moves a scripted entity past its current instruction, whatever repetitions it had left
+static void program_next(const program_t* program, int* current_move, int* current_repeat) {
+    if (!program) return;
+
+    *current_repeat = 0;
+    if (++*current_move == program->n_ops) *current_move = 0;
+}
+
+// Idle plays left after the current one by a 'T' of 'turns' turns, each turn lasting passo + 1 plays
+// The whole wait is folded into the waiting counter, so a long 'T' costs no more than a short one
+static int wait_plays(int turns, int passo) {
+    long long plays = (long long)turns * (passo + 1) - 1;
+    if (plays > INT_MAX) return INT_MAX;
+    return (plays > 0) ? (int)plays : 0;
+}
+
 // Handles the movement logic for a Pacman, including collisions and point collection
-int move_pacman(board_t* board, int pacman_index, command_t* command) {
+// 'played' receives the direction it took, the draw for an 'R', and stays 0 for a play spent waiting
+static int play_pacman(board_t* board, int pacman_index, const command_t* command, char* played) {
     if (pacman_index < 0) return DEAD_PACMAN;
     
     pacman_t* pac = &board->pacmans[pacman_index];
     if (!pac->alive) return DEAD_PACMAN;
+    preserve_entity(board, HISTORY_PACMAN, pacman_index);
 
     int current_x = pac->pos_x;
     int current_y = pac->pos_y;
@@ -102,9 +584,9 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
     char direction = command->command;
 
     if (direction == 'R') {
-        char directions[] = {'W', 'S', 'A', 'D'};
-        direction = directions[rand() % 4];
+        direction = random_direction(&pac->rng);
     }
+    *played = direction;
 
     switch (direction) {
         case 'W': new_y--; break;
@@ -112,17 +594,14 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
         case 'A': new_x--; break;
         case 'D': new_x++; break;
         case 'T':
-            if (command->turns_left == 1) {
-                pac->current_move += 1;
-                command->turns_left = command->turns;
-            }
-            else command->turns_left -= 1;
+            pac->waiting = wait_plays(command->turns, pac->passo);
+            program_next(pac->program, &pac->current_move, &pac->current_repeat);
             return VALID_MOVE;
         default:
             return INVALID_MOVE;
     }
 
-    pac->current_move += 1;
+    program_step(pac->program, &pac->current_move, &pac->current_repeat);
 
     if (!is_valid_position(board, new_x, new_y)) {
         return INVALID_MOVE;
@@ -131,6 +610,10 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
     int old_index = get_board_index(board, current_x, current_y);
     int new_index = get_board_index(board, new_x, new_y);
 
+    if (board->lockfree) {
+        return move_pacman_lockfree(board, pacman_index, old_index, new_index);
+    }
+
     lock_two_positions(board, old_index, new_index);
 
     if (!pac->alive || pac->pos_x != current_x || pac->pos_y != current_y) {
@@ -142,11 +625,11 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
     int ret_val = VALID_MOVE;
 
     if (board->board[new_index].has_portal) {
-        board->board[old_index].content = ' ';
-        board->board[new_index].content = 'P';
+        set_cell_occupant(board, old_index, OCC_EMPTY);
+        set_cell_occupant(board, new_index, OCC_PACMAN(pacman_index));
         ret_val = REACHED_PORTAL;
     }
-    else if (target_content == 'W') {
+    else if (target_content == 'W' || target_content == 'P') {
         ret_val = INVALID_MOVE;
     }
     else if (target_content == 'M') {
@@ -156,13 +639,14 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
     else {
         if (board->board[new_index].has_dot) {
             pac->points++;
+            preserve_cell(board, new_index);
             board->board[new_index].has_dot = 0;
         }
 
-        board->board[old_index].content = ' ';
+        set_cell_occupant(board, old_index, OCC_EMPTY);
         pac->pos_x = new_x;
         pac->pos_y = new_y;
-        board->board[new_index].content = 'P';
+        set_cell_occupant(board, new_index, OCC_PACMAN(pacman_index));
     }
 
     unlock_two_positions(board, old_index, new_index);
@@ -171,50 +655,44 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
 }
 
 // Calculates the final destination for a 'charged' move (straight line until obstacle)
+// The first wall, ghost or pacman on the way is found with a bit scan over the row or column bitplanes
 static int get_charged_dest(board_t* board, int x, int y, char direction, int* dest_x, int* dest_y) {
+    bitplanes_t* planes = &board->planes;
+    int row_base = y * planes->row_words;
+    int col_base = x * planes->col_words;
+    int hit;
+
     *dest_x = x;
     *dest_y = y;
-    
+
     switch (direction) {
         case 'W':
-            if (y == 0) return 0;
-            *dest_y = 0; 
-            for (int i = y - 1; i >= 0; i--) {
-                char c = board->board[get_board_index(board, x, i)].content;
-                if (c == 'W' || c == 'M') { *dest_y = i + 1; return 0; }
-                if (c == 'P') { *dest_y = i; return 1; }
-            }
+            hit = line_scan_backward(planes->cols, col_base, y - 1);
+            if (hit < 0) { *dest_y = 0; return 0; }
+            if (line_test(planes->cols[PLANE_PACMAN] + col_base, hit)) { *dest_y = hit; return 1; }
+            *dest_y = hit + 1;
             break;
         case 'S':
-            if (y == board->height - 1) return 0;
-            *dest_y = board->height - 1;
-            for (int i = y + 1; i < board->height; i++) {
-                char c = board->board[get_board_index(board, x, i)].content;
-                if (c == 'W' || c == 'M') { *dest_y = i - 1; return 0; }
-                if (c == 'P') { *dest_y = i; return 1; }
-            }
+            hit = line_scan_forward(planes->cols, col_base, planes->col_words, y + 1);
+            if (hit < 0) { *dest_y = board->height - 1; return 0; }
+            if (line_test(planes->cols[PLANE_PACMAN] + col_base, hit)) { *dest_y = hit; return 1; }
+            *dest_y = hit - 1;
             break;
         case 'A':
-            if (x == 0) return 0;
-            *dest_x = 0;
-            for (int j = x - 1; j >= 0; j--) {
-                char c = board->board[get_board_index(board, j, y)].content;
-                if (c == 'W' || c == 'M') { *dest_x = j + 1; return 0; }
-                if (c == 'P') { *dest_x = j; return 1; }
-            }
+            hit = line_scan_backward(planes->rows, row_base, x - 1);
+            if (hit < 0) { *dest_x = 0; return 0; }
+            if (line_test(planes->rows[PLANE_PACMAN] + row_base, hit)) { *dest_x = hit; return 1; }
+            *dest_x = hit + 1;
             break;
         case 'D':
-            if (x == board->width - 1) return 0;
-            *dest_x = board->width - 1;
-            for (int j = x + 1; j < board->width; j++) {
-                char c = board->board[get_board_index(board, j, y)].content;
-                if (c == 'W' || c == 'M') { *dest_x = j - 1; return 0; }
-                if (c == 'P') { *dest_x = j; return 1; }
-            }
+            hit = line_scan_forward(planes->rows, row_base, planes->row_words, x + 1);
+            if (hit < 0) { *dest_x = board->width - 1; return 0; }
+            if (line_test(planes->rows[PLANE_PACMAN] + row_base, hit)) { *dest_x = hit; return 1; }
+            *dest_x = hit - 1;
             break;
     }
     return 0;
-}   
+}
 
 // Executes the movement logic for a ghost in 'charged' state
 int move_ghost_charged(board_t* board, int ghost_index, char direction) {
@@ -224,6 +702,7 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
     int new_x, new_y;
 
     ghost->charged = 0;
+    mark_dirty(board, get_board_index(board, cur_x, cur_y));
 
     get_charged_dest(board, cur_x, cur_y, direction, &new_x, &new_y);
 
@@ -235,6 +714,10 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
     int old_index = get_board_index(board, cur_x, cur_y);
     int new_index = get_board_index(board, new_x, new_y);
 
+    if (board->lockfree) {
+        return move_ghost_lockfree(board, ghost_index, old_index, new_index);
+    }
+
     lock_two_positions(board, old_index, new_index);
 
     if (ghost->pos_x != cur_x || ghost->pos_y != cur_y) {
@@ -246,25 +729,26 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
     int result = VALID_MOVE;
 
     if (target_content == 'P') {
-        result = find_and_kill_pacman(board, new_x, new_y);
+        result = find_and_kill_pacman(board, new_index);
     } 
     else if (target_content == 'W' || target_content == 'M') {
         unlock_two_positions(board, old_index, new_index);
         return INVALID_MOVE;
     }
 
-    board->board[old_index].content = ' '; 
+    set_cell_occupant(board, old_index, OCC_EMPTY);
     ghost->pos_x = new_x;
     ghost->pos_y = new_y;
-    board->board[new_index].content = 'M';
+    set_cell_occupant(board, new_index, OCC_GHOST(ghost_index));
 
     unlock_two_positions(board, old_index, new_index);
     return result;
 }
 
-// Executes a standard move command for a ghost
-int move_ghost(board_t* board, int ghost_index, command_t* command) {
+// Executes a standard move command for a ghost, 'played' as for play_pacman
+static int play_ghost(board_t* board, int ghost_index, const command_t* command, char* played) {
     ghost_t* ghost = &board->ghosts[ghost_index];
+    preserve_entity(board, HISTORY_GHOST, ghost_index);
     int current_x = ghost->pos_x;
     int current_y = ghost->pos_y;
     int new_x = current_x;
@@ -279,9 +763,9 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
     char direction = command->command;
     
     if (direction == 'R') {
-        char directions[] = {'W', 'S', 'A', 'D'};
-        direction = directions[rand() % 4];
+        direction = random_direction(&ghost->rng);
     }
+    *played = direction;
 
     switch (direction) {
         case 'W': new_y--; break;
@@ -289,21 +773,19 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
         case 'A': new_x--; break;
         case 'D': new_x++; break;
         case 'C':
-            ghost->current_move += 1;
+            program_step(ghost->program, &ghost->current_move, &ghost->current_repeat);
             ghost->charged = 1;
+            mark_dirty(board, get_board_index(board, current_x, current_y));
             return VALID_MOVE;
         case 'T':
-            if (command->turns_left == 1) {
-                ghost->current_move += 1; 
-                command->turns_left = command->turns;
-            }
-            else command->turns_left -= 1;
+            ghost->waiting = wait_plays(command->turns, ghost->passo);
+            program_next(ghost->program, &ghost->current_move, &ghost->current_repeat);
             return VALID_MOVE;
         default:
             return INVALID_MOVE;
     }
 
-    ghost->current_move++;
+    program_step(ghost->program, &ghost->current_move, &ghost->current_repeat);
     
     if (ghost->charged)
         return move_ghost_charged(board, ghost_index, direction);
@@ -315,6 +797,10 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
     int old_index = get_board_index(board, current_x, current_y);
     int new_index = get_board_index(board, new_x, new_y);
 
+    if (board->lockfree) {
+        return move_ghost_lockfree(board, ghost_index, old_index, new_index);
+    }
+
     lock_two_positions(board, old_index, new_index);
 
     if (ghost->pos_x != current_x || ghost->pos_y != current_y) {
@@ -331,28 +817,66 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
 
     int result = VALID_MOVE;
     if (target_content == 'P') {
-        result = find_and_kill_pacman(board, new_x, new_y);
+        result = find_and_kill_pacman(board, new_index);
     }
 
-    board->board[old_index].content = ' '; 
+    set_cell_occupant(board, old_index, OCC_EMPTY);
     ghost->pos_x = new_x;
     ghost->pos_y = new_y;
-    board->board[new_index].content = 'M';
+    set_cell_occupant(board, new_index, OCC_GHOST(ghost_index));
 
     unlock_two_positions(board, old_index, new_index);
     return result;
 }
 
+int move_pacman(board_t* board, int pacman_index, const command_t* command) {
+    uint64_t start = metrics_now();
+    char played = 0;
+    int result = play_pacman(board, pacman_index, command, &played);
+    metrics_record(HIST_MOVE_PACMAN, metrics_now() - start);
+    metrics_count(COUNTER_MOVES, 1);
+    if (board->trace) trace_played(board, TRACE_PACMAN, pacman_index, command, played, result);
+    return result;
+}
+
+int move_ghost(board_t* board, int ghost_index, const command_t* command) {
+    uint64_t start = metrics_now();
+    char played = 0;
+    int result = play_ghost(board, ghost_index, command, &played);
+    metrics_record(HIST_MOVE_GHOST, metrics_now() - start);
+    metrics_count(COUNTER_MOVES, 1);
+    if (board->trace) trace_played(board, TRACE_GHOST, ghost_index, command, played, result);
+    return result;
+}
+
 // Sets the specified Pacman as dead and removes it from the board
 void kill_pacman(board_t* board, int pacman_index) {
     debug("Killing %d pacman\n\n", pacman_index);
     pacman_t* pac = &board->pacmans[pacman_index];
     int index = pac->pos_y * board->width + pac->pos_x;
 
-    board->board[index].content = ' ';
+    set_cell_occupant(board, index, OCC_EMPTY);
     pac->alive = 0;
 }
 
+// Counts the pacmans still alive, movers may be killing others meanwhile
+int pacmans_alive(board_t* board) {
+    int alive = 0;
+    for (int p = 0; p < board->n_pacmans; p++) {
+        alive += __atomic_load_n(&board->pacmans[p].alive, __ATOMIC_ACQUIRE) != 0;
+    }
+    return alive;
+}
+
+// Adds up the points of every pacman, dead ones included
+int pacmans_points(board_t* board) {
+    int points = 0;
+    for (int p = 0; p < board->n_pacmans; p++) {
+        points += __atomic_load_n(&board->pacmans[p].points, __ATOMIC_RELAXED);
+    }
+    return points;
+}
+
 // Initializes the Pacman structure (used for static loading)
 int load_pacman(board_t* board, int points) {
     board->pacmans[0].pos_x = -1;
@@ -370,15 +894,10 @@ int load_ghost(board_t* board) {
     board->ghosts[0].passo = 0;
     board->ghosts[0].waiting = 0;
     board->ghosts[0].current_move = 0;
-    board->ghosts[0].n_moves = 16;
-    for (int i = 0; i < 8; i++) {
-        board->ghosts[0].moves[i].command = 'D';
-        board->ghosts[0].moves[i].turns = 1; 
-    }
-    for (int i = 8; i < 16; i++) {
-        board->ghosts[0].moves[i].command = 'A';
-        board->ghosts[0].moves[i].turns = 1; 
-    }
+    program_t* back_and_forth = add_program(board, "static ghost 0", 2);
+    back_and_forth->ops[0] = (command_t){ .command = 'D', .turns = 8 };
+    back_and_forth->ops[1] = (command_t){ .command = 'A', .turns = 8 };
+    board->ghosts[0].program = back_and_forth;
 
     board->board[2 * board->width + 4].content = 'M';
     board->ghosts[1].pos_x = 4;
@@ -386,9 +905,9 @@ int load_ghost(board_t* board) {
     board->ghosts[1].passo = 1;
     board->ghosts[1].waiting = 1;
     board->ghosts[1].current_move = 0;
-    board->ghosts[1].n_moves = 1;
-    board->ghosts[1].moves[0].command = 'R';
-    board->ghosts[1].moves[0].turns = 1; 
+    program_t* random_walk = add_program(board, "static ghost 1", 1);
+    random_walk->ops[0] = (command_t){ .command = 'R', .turns = 1 };
+    board->ghosts[1].program = random_walk;
     
     return 0;
 }
@@ -403,10 +922,6 @@ int load_level(board_t *board, int points) {
     board->n_pacmans = 1;
 
     board->board = calloc(board->width * board->height, sizeof(board_pos_t));
-    
-    for(int i = 0; i < board->width * board->height; i++) {
-        pthread_mutex_init(&board->board[i].mutex, NULL);
-    }
 
     board->pacmans = calloc(board->n_pacmans, sizeof(pacman_t));
     board->ghosts = calloc(board->n_ghosts, sizeof(ghost_t));
@@ -431,24 +946,102 @@ int load_level(board_t *board, int points) {
 
     load_ghost(board);
     load_pacman(board, points);
+    prepare_board(board);
 
     return 0;
 }
 
-// Reads the full content of a file into a dynamically allocated string
-char* read_file_content(const char* filename) {
+// Maps a whole file read-only into memory, returns 0 on success
+int map_file(const char* filename, mapped_file_t* file) {
+    file->data = NULL;
+    file->size = 0;
+
     int fd = open(filename, O_RDONLY);
-    if (fd < 0) return NULL; 
-    
-    char *buffer = calloc(4096, sizeof(char)); 
-    if (!buffer) { close(fd); return NULL; }
+    if (fd < 0) return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return 1; }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 1;
+
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    file->data = data;
+    file->size = st.st_size;
+    return 0;
+}
+
+// Releases a mapping created by map_file
+void unmap_file(mapped_file_t* file) {
+    if (file->data) munmap((void *)file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+// Returns the next non-empty line of a mapped file without copying it, 0 once the file is over
+static int next_line(const char** cursor, const char* end, const char** line, size_t* len) {
+    const char *p = *cursor;
+
+    while (p < end && (*p == '\n' || *p == '\r')) p++;
+    if (p >= end) return 0;
+
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol) eol = end;
+
+    *line = p;
+    *len = eol - p;
+    if (*len > 0 && p[*len - 1] == '\r') (*len)--;
+    *cursor = eol;
+    return 1;
+}
+
+// Checks if a line starts with the given keyword
+static int line_starts_with(const char* line, size_t len, const char* keyword) {
+    size_t n = strlen(keyword);
+    return len >= n && memcmp(line, keyword, n) == 0;
+}
+
+// Reads a decimal integer from a line after skipping blanks, returns 1 on success
+static int parse_int(const char** p, const char* end, int* value) {
+    const char *q = *p;
+    while (q < end && (*q == ' ' || *q == '\t')) q++;
+
+    int sign = 1;
+    if (q < end && (*q == '-' || *q == '+')) {
+        if (*q == '-') sign = -1;
+        q++;
+    }
+    if (q >= end || !isdigit((unsigned char)*q)) return 0;
+
+    long result = 0;
+    while (q < end && isdigit((unsigned char)*q)) {
+        result = result * 10 + (*q - '0');
+        // Out of range, the caller rejects the line
+        if (result > INT_MAX) return 0;
+        q++;
+    }
+
+    *value = (int)(sign * result);
+    *p = q;
+    return 1;
+}
+
+// Reads the next blank separated word of a line into 'word', returns 0 if there is none
+static int next_word(const char** p, const char* end, char* word, size_t size) {
+    const char *q = *p;
+    while (q < end && isspace((unsigned char)*q)) q++;
+    if (q >= end) return 0;
 
-    int bytes_lidos = read(fd, buffer, 4095);
-    if (bytes_lidos <= 0) { free(buffer); close(fd); return NULL; }
+    const char *start = q;
+    while (q < end && !isspace((unsigned char)*q)) q++;
 
-    buffer[bytes_lidos] = '\0';
-    close(fd); 
-    return buffer;
+    size_t n = q - start;
+    if (n >= size) n = size - 1;
+    memcpy(word, start, n);
+    word[n] = '\0';
+    *p = q;
+    return 1;
 }
 
 // Checks if a position on the board is valid for placing an entity
@@ -462,202 +1055,306 @@ int is_valid_pos(board_t *board, int x, int y) {
 }
     
 // Parses a single line from a file into a move command structure
-int parse_move_line(char *linha, command_t *moves_array, int *n_moves) {
-    if (*n_moves >= MAX_MOVES) return 0;
+int parse_move_line(const char *linha, size_t len, command_t **moves_array, int *n_moves, int *capacity) {
+    if (len == 0) return 0;
 
-    char cmd = '\0';
+    char cmd = linha[0];
     int turns = 1;
 
-    if (linha[0] == 'T') {
-        cmd = 'T';
-        if (sscanf(linha + 1, "%d", &turns) != 1) {
+    if (cmd == 'T') {
+        const char *p = linha + 1;
+        if (!parse_int(&p, linha + len, &turns) || turns < 1) {
             turns = 1;
         }
-    } 
-    else {
-        cmd = linha[0];
     }
 
     if (cmd != '\0') {
-        moves_array[*n_moves].command = cmd;
-        moves_array[*n_moves].turns = turns;
-        moves_array[*n_moves].turns_left = turns;
+        // Same command as the last one, run-length encode it
+        if (*n_moves > 0 && (*moves_array)[*n_moves - 1].command == cmd) {
+            command_t *last = &(*moves_array)[*n_moves - 1];
+            last->turns = (last->turns > INT_MAX - turns) ? INT_MAX : last->turns + turns;
+            return 1;
+        }
+
+        if (*n_moves == *capacity) {
+            int new_capacity = (*capacity > 0) ? *capacity * 2 : 8;
+            command_t *grown = realloc(*moves_array, new_capacity * sizeof(command_t));
+            if (!grown) return 0;
+            *moves_array = grown;
+            *capacity = new_capacity;
+        }
+
+        command_t *move = &(*moves_array)[*n_moves];
+        move->command = cmd;
+        move->turns = turns;
         (*n_moves)++;
         return 1;
     }
     return 0;
 }
 
+// Allocates a program and appends it to the board's program list
+program_t* add_program(board_t* board, const char* file, int n_ops) {
+    // The list grows every time its length reaches a power of two
+    if ((board->n_programs & (board->n_programs - 1)) == 0) {
+        int new_capacity = (board->n_programs > 0) ? board->n_programs * 2 : 1;
+        board->programs = realloc(board->programs, new_capacity * sizeof(program_t *));
+    }
+
+    program_t* program = calloc(1, sizeof(program_t) + n_ops * sizeof(command_t));
+    program->file = strdup(file);
+    program->n_ops = n_ops;
+    board->programs[board->n_programs++] = program;
+    return program;
+}
+
+// Looks a program up by the file it was compiled from, levels use only a handful of distinct files
+program_t* find_program(board_t* board, const char* file) {
+    for (int i = 0; i < board->n_programs; i++) {
+        if (strcmp(board->programs[i]->file, file) == 0) return board->programs[i];
+    }
+    return NULL;
+}
+
+// Compiles an entity file into a program of the board, NULL if the file cannot be read
+static program_t* compile_program(board_t *board, const char* filename) {
+    mapped_file_t file;
+    if (map_file(filename, &file) != 0) return NULL;
+
+    command_t *ops = NULL;
+    int n_ops = 0;
+    int capacity = 0;
+    int passo = 0, pos_x = 0, pos_y = 0, has_pos = 0;
+
+    const char *cursor = file.data;
+    const char *end = file.data + file.size;
+    const char *linha;
+    size_t len;
+
+    while (next_line(&cursor, end, &linha, &len)) {
+        if (linha[0] == '#') continue;
+
+        const char *p = linha;
+        if (line_starts_with(linha, len, "PASSO")) {
+            int passo_val;
+            p += 5;
+            if (parse_int(&p, linha + len, &passo_val)) {
+                passo = passo_val;
+            }
+        }
+        else if (line_starts_with(linha, len, "POS")) {
+            int l, c;
+            p += 3;
+            if (parse_int(&p, linha + len, &l) && parse_int(&p, linha + len, &c)) {
+                pos_y = l;
+                pos_x = c;
+                has_pos = 1;
+            }
+        }
+        else {
+            parse_move_line(linha, len, &ops, &n_ops, &capacity);
+        }
+    }
+    unmap_file(&file);
+
+    program_t *program = add_program(board, filename, n_ops);
+    program->passo = passo;
+    program->pos_x = pos_x;
+    program->pos_y = pos_y;
+    program->has_pos = has_pos;
+    if (n_ops > 0) memcpy(program->ops, ops, n_ops * sizeof(command_t));
+    free(ops);
+    return program;
+}
+
 // Loads entity (Pacman/Ghost) configuration from a file
+// Entities naming the same file share the program compiled the first time it was read
 int load_entity_file(board_t *board, const char* filename, int index, int is_pacman, int points) {
-    char *buffer = read_file_content(filename);
+    program_t *program = find_program(board, filename);
+    if (!program) program = compile_program(board, filename);
 
-    if (!buffer) {
+    if (!program) {
         if (is_pacman) {
-            load_pacman(board, points);
-            board->pacmans[index].n_moves = 0; 
+            pacman_t *p = &board->pacmans[index];
+            *p = (pacman_t){ .pos_x = -1, .pos_y = -1, .alive = 1, .points = points };
         }
         return 0;
     }
 
-    int *e_passo, *e_pos_x, *e_pos_y, *e_n_moves, *e_waiting;
-    command_t *e_moves;
+    // A script with no moves leaves the pacman to the user and the ghost standing still
+    const program_t *moves = (program->n_ops > 0) ? program : NULL;
+    int *e_pos_x, *e_pos_y;
 
     if (is_pacman) {
         pacman_t *p = &board->pacmans[index];
         p->alive = 1; 
         p->points = points;
+        p->program = moves;
         p->current_move = 0;
-        e_passo = &p->passo;
-        e_waiting = &p->waiting;
+        p->current_repeat = 0;
+        p->passo = program->passo;
+        p->waiting = program->passo;
+        p->pos_x = -1;
+        p->pos_y = -1;
         e_pos_x = &p->pos_x;
         e_pos_y = &p->pos_y;
-        e_n_moves = &p->n_moves;
-        e_moves = p->moves;
     } else {
         ghost_t *g = &board->ghosts[index];
         g->charged = 0;
+        g->program = moves;
         g->current_move = 0;
-        e_passo = &g->passo;
-        e_waiting = &g->waiting;
+        g->current_repeat = 0;
+        g->passo = program->passo;
+        g->waiting = program->passo;
         e_pos_x = &g->pos_x;
         e_pos_y = &g->pos_y;
-        e_n_moves = &g->n_moves;
-        e_moves = g->moves;
     }
-    
-    *e_n_moves = 0;
-    *e_waiting = 0;
-    *e_passo = 0;
-
-    char *saveptr; 
-    char *linha = strtok_r(buffer, "\n", &saveptr);
-
-    while(linha != NULL){
-        if(linha[0] != '#'){
-            if(strncmp(linha, "PASSO", 5) == 0){
-                int passo_val;
-                if(sscanf(linha, "PASSO %d", &passo_val) == 1){
-                    *e_passo = passo_val;
-                    *e_waiting = passo_val;
-                }
-            }
-            else if (strncmp(linha, "POS", 3) == 0){
-                int l, c;
-                if(sscanf(linha, "POS %d %d", &l, &c) == 2){
-                    *e_pos_y = l;
-                    *e_pos_x = c;
-                    if(is_valid_pos(board, c, l)){
-                        int idx = l * board->width + c;
-                        if (is_pacman) {
-                            board->board[idx].content = 'P';
-                            board->board[idx].has_dot = 0;
-                        } else {
-                            board->board[idx].content = 'M';
-                        }
-                    }
-                }
-            }
-            else {
-                parse_move_line(linha, e_moves, e_n_moves);
+
+    if (program->has_pos) {
+        int l = program->pos_y, c = program->pos_x;
+        *e_pos_y = l;
+        *e_pos_x = c;
+        if (is_valid_pos(board, c, l)) {
+            int idx = l * board->width + c;
+            if (is_pacman) {
+                board->board[idx].content = 'P';
+                board->board[idx].has_dot = 0;
+            } else {
+                board->board[idx].content = 'M';
             }
         }
-        linha = strtok_r(NULL, "\n", &saveptr);
     }
-    
-    free(buffer);
+
     return 0;
 }
 
 // Parses lines from the level file that specify entity files (PAC/MON)
-void process_entities(board_t *board, char *linha, int tipo, int points) {
-    char temp_name[50];
-    int offset = 0;
+void process_entities(board_t *board, const char *linha, size_t len, int tipo, int points) {
+    char temp_name[MAX_FILENAME];
+    const char *end = linha + len;
+    const char *cursor = linha + 3;
     int count = 0;
-    char *cursor = linha + 3; 
 
-    while (sscanf(cursor, "%s%n", temp_name, &offset) == 1) {
+    while (next_word(&cursor, end, temp_name, sizeof(temp_name))) {
         count++;
-        cursor += offset;
+    }
+    if (count > OCC_MAX_ENTITIES) {
+        log_warn("Level lists %d entities, only the first %d are loaded\n", count, OCC_MAX_ENTITIES);
+        count = OCC_MAX_ENTITIES;
     }
     if (tipo == 0) {
         board->n_pacmans = count;
         board->pacmans = calloc(count, sizeof(pacman_t));
+        board->pacmans_files = calloc(count, sizeof(char *));
     } else {
         board->n_ghosts = count;
         board->ghosts = calloc(count, sizeof(ghost_t));
+        board->ghosts_files = calloc(count, sizeof(char *));
     }
 
     cursor = linha + 3;
     int i = 0;
-    while (sscanf(cursor, "%s%n", temp_name, &offset) == 1) {
-        if (tipo == 0) load_entity_file(board, temp_name, i, 1, points); 
-        else load_entity_file(board, temp_name, i, 0, 0);
-        cursor += offset;
+    while (i < count && next_word(&cursor, end, temp_name, sizeof(temp_name))) {
+        if (tipo == 0) {
+            if (i == 0) snprintf(board->pacman_file, sizeof(board->pacman_file), "%s", temp_name);
+            board->pacmans_files[i] = strdup(temp_name);
+            // Points carried over from the last level go to the first pacman, so they are only counted once
+            load_entity_file(board, temp_name, i, 1, i == 0 ? points : 0);
+        } else {
+            board->ghosts_files[i] = strdup(temp_name);
+            load_entity_file(board, temp_name, i, 0, 0);
+        }
         i++;
     }
 }
 
+// Fills one row of the map from its line in the level file
+static void parse_map_row(board_t *board, int row, const char *linha, size_t len) {
+    board_pos_t *cells = &board->board[row * board->width];
+    int n = (len < (size_t)board->width) ? (int)len : board->width;
+
+    for (int x = 0; x < n; x++) {
+        char char_lido = linha[x];
+        char conteudo_atual = cells[x].content;
+
+        if (char_lido == 'X') {
+            cells[x].content = 'W'; 
+        } 
+        else if (char_lido == '@') {
+            if (conteudo_atual != 'P' && conteudo_atual != 'M')
+                cells[x].content = ' ';
+            cells[x].has_portal = 1;
+        } 
+        else {
+            if (conteudo_atual != 'P' && conteudo_atual != 'M') {
+                cells[x].content = ' '; 
+            }
+            cells[x].has_dot = 1;
+        }
+    }
+}
+
 // Loads the level configuration and map from a filename
+// The file is mapped and parsed in place in a single pass
 int load_level_filename(board_t *board, const char *filename, int points) {
-    char *buffer = read_file_content(filename);
-    if (!buffer) return 1;
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    char *saveptr;
-    char *linha = strtok_r(buffer, "\n", &saveptr);
+    mapped_file_t file;
+    if (map_file(filename, &file) != 0) return 1;
+
+    const char *cursor = file.data;
+    const char *end = file.data + file.size;
+    const char *linha;
+    size_t len;
     int current_row = 0; 
 
-    while (linha != NULL) {
-        if (linha[0] != '#') {
-            if (strncmp(linha, "DIM", 3) == 0) {
-                int h, w;
-                if (sscanf(linha, "DIM %d %d", &h, &w) == 2) {
-                    board->height = h;
-                    board->width = w;
-                    board->board = calloc(board->width * board->height, sizeof(board_pos_t));
-                    
-                    for(int i = 0; i < board->width * board->height; i++) {
-                        pthread_mutex_init(&board->board[i].mutex, NULL);
-                    }
-                }
-            } 
-            else if (strncmp(linha, "TEMPO", 5) == 0) {
-                int t;
-                if (sscanf(linha, "TEMPO %d", &t) == 1) board->tempo = t; 
-            }
-            else if(strncmp(linha, "PAC", 3) == 0) process_entities(board, linha, 0, points);
-            else if (strncmp(linha, "MON", 3) == 0) process_entities(board, linha, 1, 0);
-            else {
-                if (board->board != NULL && current_row < board->height) {
-                    for (int x = 0; x < board->width && linha[x] != '\0'; x++) {
-                        int index = (current_row * board->width) + x;
-                        char char_lido = linha[x];
-                        char conteudo_atual = board->board[index].content;
-
-                        if (char_lido == 'X') {
-                            board->board[index].content = 'W'; 
-                        } 
-                        else if (char_lido == '@') {
-                            if (conteudo_atual != 'P' && conteudo_atual != 'M')
-                                board->board[index].content = ' ';
-                            board->board[index].has_portal = 1;
-                        } 
-                        else {
-                            if (conteudo_atual != 'P' && conteudo_atual != 'M') {
-                                board->board[index].content = ' '; 
-                            }
-                            board->board[index].has_dot = 1;
-                        }
-                    }
-                    current_row++; 
-                }
+    while (next_line(&cursor, end, &linha, &len)) {
+        if (linha[0] == '#') continue;
+
+        const char *p = linha;
+        if (line_starts_with(linha, len, "DIM")) {
+            int h, w;
+            p += 3;
+            if (parse_int(&p, linha + len, &h) && parse_int(&p, linha + len, &w) && h > 0 && w > 0) {
+                board->height = h;
+                board->width = w;
+                board->board = calloc((size_t)board->width * board->height, sizeof(board_pos_t));
             }
+        } 
+        else if (line_starts_with(linha, len, "TEMPO")) {
+            int t;
+            p += 5;
+            if (parse_int(&p, linha + len, &t)) board->tempo = t; 
+        }
+        else if (line_starts_with(linha, len, "PAC")) process_entities(board, linha, len, 0, points);
+        else if (line_starts_with(linha, len, "MON")) process_entities(board, linha, len, 1, 0);
+        else if (board->board != NULL && current_row < board->height) {
+            parse_map_row(board, current_row, linha, len);
+            current_row++; 
         }
-        linha = strtok_r(NULL, "\n", &saveptr);
     }
     
-    pacman_t *pac = board->pacmans;
-    if (pac->n_moves == 0 || (pac->pos_x == -1 && pac->pos_y == -1)) { 
+    size_t file_size = file.size;
+    unmap_file(&file);
+
+    if (board->board == NULL) {
+        log_error("Level %s has no DIM line\n", filename);
+        unload_level(board);
+        return 1;
+    }
+
+    // Levels without a PAC line still get one user controlled pacman
+    if (board->pacmans == NULL) {
+        board->n_pacmans = 1;
+        board->pacmans = calloc(1, sizeof(pacman_t));
+        load_pacman(board, points);
+    }
+
+    // Pacmans without a POS line take the free cells in reading order
+    for (int p = 0; p < board->n_pacmans; p++) {
+        pacman_t *pac = &board->pacmans[p];
+        if (pac->pos_x != -1 || pac->pos_y != -1) continue;
         find_first_free_pos(board, &pac->pos_x, &pac->pos_y);
         int idx = pac->pos_y * board->width + pac->pos_x;
         if (is_valid_position(board, pac->pos_x, pac->pos_y)) {
@@ -665,81 +1362,82 @@ int load_level_filename(board_t *board, const char *filename, int points) {
         }
     }
 
-    free(buffer);
+    prepare_board(board);
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    board->load_ms = (finish.tv_sec - start.tv_sec) * 1e3 + (finish.tv_nsec - start.tv_nsec) / 1e6;
+    log_info("Parsed %s (%zu bytes, %dx%d, %d ghosts) in %.3f ms\n", filename, file_size,
+          board->width, board->height, board->n_ghosts, board->load_ms);
+
     return 0;
 }
 
 // Frees all allocated memory for the level and destroys mutexes
 void unload_level(board_t * board) {
-    if (board->board) {
-        for(int i = 0; i < board->width * board->height; i++) {
-            pthread_mutex_destroy(&board->board[i].mutex);
+    if (board->locks) {
+        for (int i = 0; i < board->n_locks; i++) {
+            pthread_mutex_destroy(&board->locks[i]);
         }
-        free(board->board);
+        free(board->locks);
     }
+    if (board->cells_mapped) munmap(board->board, board->cells_mapped);
+    else free(board->board);
+    free(board->occupancy);
+    free(board->dirty.ring);
+    free(board->dirty.marks);
+    for (int plane = 0; plane < N_PLANES; plane++) {
+        free(board->planes.rows[plane]);
+        free(board->planes.cols[plane]);
+    }
+    for (int p = 0; p < board->n_pacmans; p++) {
+        if (board->pacmans_files) free(board->pacmans_files[p]);
+    }
+    for (int g = 0; g < board->n_ghosts; g++) {
+        if (board->ghosts_files) free(board->ghosts_files[g]);
+    }
+    for (int i = 0; i < board->n_programs; i++) {
+        free(board->programs[i]->file);
+        free(board->programs[i]);
+    }
+    free(board->programs);
+    free(board->ghosts_files);
+    free(board->pacmans_files);
     free(board->pacmans);
     free(board->ghosts);
 }
 
-// Opens the debug log file for writing
-void open_debug_file(char *filename) {
-    debugfile = fopen(filename, "w");
-}
-
-// Closes the debug log file
-void close_debug_file() {
-    fclose(debugfile);
-}
-
-// Writes formatted output to the debug log file
-void debug(const char * format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(debugfile, format, args);
-    va_end(args);
-    fflush(debugfile);
-}
-
-// Prints the current state of the board and entities to the debug log
+// Prints the current state of the board and entities to the debug log, one row per record so no board is cut short
 void print_board(board_t *board) {
+    if (LOG_LEVEL < LOG_DEBUG) return;
+
     if (!board || !board->board) {
         debug("[%d] Board is empty or not initialized.\n", getpid());
         return;
     }
 
-    char buffer[8192];
-    size_t offset = 0;
-
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-                       "=== [%d] LEVEL INFO ===\n"
-                       "Dimensions: %d x %d\n"
-                       "Tempo: %d\n"
-                       "Pacman file: %s\n",
-                       getpid(), board->height, board->width, board->tempo, board->pacman_file);
-
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-                       "Monster files (%d):\n", board->n_ghosts);
+    debug("=== [%d] LEVEL INFO ===\n"
+          "Dimensions: %d x %d\n"
+          "Tempo: %d\n"
+          "Pacman file: %s\n"
+          "Monster files (%d):\n",
+          getpid(), board->height, board->width, board->tempo, board->pacman_file, board->n_ghosts);
 
     for (int i = 0; i < board->n_ghosts; i++) {
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-                           "  - %s\n", board->ghosts_files[i]);
+        debug("  - %s\n", board->ghosts_files ? board->ghosts_files[i] : "(static)");
     }
 
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "\n=== BOARD ===\n");
+    log_append("\n=== BOARD ===\n", 15, 1);
 
+    char* row = malloc(board->width + 1);
+    if (!row) return;
     for (int y = 0; y < board->height; y++) {
         for (int x = 0; x < board->width; x++) {
-            int idx = y * board->width + x;
-            if (offset < sizeof(buffer) - 2) {
-                buffer[offset++] = board->board[idx].content;
-            }
-        }
-        if (offset < sizeof(buffer) - 2) {
-            buffer[offset++] = '\n';
+            row[x] = board->board[y * board->width + x].content;
         }
+        row[board->width] = '\n';
+        log_append(row, board->width + 1, 1);
     }
+    free(row);
 
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "==================\n");
-    buffer[offset] = '\0';
-    debug("%s", buffer);
-}
\ No newline at end of file
+    log_append("==================\n", 19, 1);
+}
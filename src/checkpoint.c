@@ -0,0 +1,303 @@
+#include "checkpoint.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "PACSAV1"
+#define SNAPSHOT_VERSION 2
+
+// Fixed header at the start of a snapshot file, followed by the entities and then the cells
+// The file is written in the host's byte order, like the level cache
+typedef struct {
+    char magic[8];                 // SNAPSHOT_MAGIC
+    uint32_t version;              // SNAPSHOT_VERSION
+    uint32_t cell_size;            // sizeof(board_pos_t) when the snapshot was written
+    int32_t level;                 // position of the level in the level list
+    char level_name[MAX_FILENAME]; // file name of the level
+    int32_t width, height;         // dimensions of the board
+    int32_t n_pacmans;             // pacman records after the header
+    int32_t n_ghosts;              // ghost records after the pacmans
+} snapshot_header_t;
+
+// Progress of a pacman or ghost, its program comes from the level when it is loaded again
+typedef struct {
+    int32_t pos_x, pos_y;
+    int32_t alive;
+    int32_t points;
+    int32_t passo;
+    int32_t current_move;
+    int32_t current_repeat;
+    int32_t waiting;
+    int32_t charged;
+    uint32_t rng;
+} snapshot_entity_t;
+
+// First cell of a page and how many cells it holds, the last page may be short
+static int page_cells(const checkpoint_t* ckpt, int page, int* first) {
+    int n_cells = ckpt->width * ckpt->height;
+    *first = page * CHECKPOINT_PAGE_CELLS;
+    return (n_cells - *first < CHECKPOINT_PAGE_CELLS) ? n_cells - *first : CHECKPOINT_PAGE_CELLS;
+}
+
+void checkpoint_take(checkpoint_t* ckpt, board_t* board, int level) {
+    int n_cells = board->width * board->height;
+    memset(ckpt, 0, sizeof(*ckpt));
+
+    ckpt->level = level;
+    ckpt->width = board->width;
+    ckpt->height = board->height;
+    ckpt->n_pages = (n_cells + CHECKPOINT_PAGE_CELLS - 1) / CHECKPOINT_PAGE_CELLS;
+    ckpt->page_state = calloc(ckpt->n_pages, sizeof(uint8_t));
+    ckpt->saved = malloc(ckpt->n_pages * sizeof(int));
+    // Left to the allocator's zero pages until a page of the board is saved into it
+    ckpt->cells = calloc(n_cells, sizeof(board_pos_t));
+
+    ckpt->n_pacmans = board->n_pacmans;
+    ckpt->pacmans = malloc(board->n_pacmans * sizeof(pacman_t));
+    memcpy(ckpt->pacmans, board->pacmans, board->n_pacmans * sizeof(pacman_t));
+    ckpt->n_ghosts = board->n_ghosts;
+    ckpt->ghosts = malloc(board->n_ghosts * sizeof(ghost_t));
+    memcpy(ckpt->ghosts, board->ghosts, board->n_ghosts * sizeof(ghost_t));
+
+    board->checkpoint = ckpt;
+}
+
+// The first writer of a page copies it, writers of its other cells wait the few instructions that takes
+void checkpoint_save_page(checkpoint_t* ckpt, board_t* board, int index) {
+    int page = index / CHECKPOINT_PAGE_CELLS;
+    uint8_t* state = &ckpt->page_state[page];
+    if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == PAGE_SAVED) return;
+
+    uint8_t expected = PAGE_UNTOUCHED;
+    if (__atomic_compare_exchange_n(state, &expected, PAGE_COPYING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        int first;
+        int count = page_cells(ckpt, page, &first);
+        memcpy(&ckpt->cells[first], &board->board[first], count * sizeof(board_pos_t));
+        ckpt->saved[__atomic_fetch_add(&ckpt->n_saved, 1, __ATOMIC_ACQ_REL)] = page;
+        __atomic_store_n(state, PAGE_SAVED, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != PAGE_SAVED) continue;
+}
+
+void checkpoint_detach(checkpoint_t* ckpt, board_t* board) {
+    if (ckpt->detached) return;
+
+    for (int page = 0; page < ckpt->n_pages; page++) {
+        checkpoint_save_page(ckpt, board, page * CHECKPOINT_PAGE_CELLS);
+    }
+    ckpt->detached = 1;
+    board->checkpoint = NULL;
+}
+
+// A snapshot file may outlive an edit of the scripts, a counter past the end of its program starts it over
+static void fit_program_counter(const program_t* program, int* current_move, int* current_repeat) {
+    int n_ops = program ? program->n_ops : 0;
+    if (*current_move < 0 || *current_move >= (n_ops > 0 ? n_ops : 1) ||
+        *current_repeat < 0 || (n_ops > 0 && *current_repeat >= program->ops[*current_move].turns)) {
+        *current_move = 0;
+        *current_repeat = 0;
+    }
+}
+
+// Copies the saved entities back, each one keeps the program of the board it is restored into
+int checkpoint_restore(checkpoint_t* ckpt, board_t* board) {
+    if (board->width != ckpt->width || board->height != ckpt->height ||
+        board->n_pacmans != ckpt->n_pacmans || board->n_ghosts != ckpt->n_ghosts) {
+        return 1;
+    }
+
+    // Restoring is not a move, nothing written from here on belongs in the checkpoint
+    if (board->checkpoint == ckpt) board->checkpoint = NULL;
+
+    for (int s = 0; s < ckpt->n_saved; s++) {
+        int first;
+        int count = page_cells(ckpt, ckpt->saved[s], &first);
+        memcpy(&board->board[first], &ckpt->cells[first], count * sizeof(board_pos_t));
+        resync_cells(board, first, count);
+    }
+
+    for (int p = 0; p < board->n_pacmans; p++) {
+        pacman_t* pac = &board->pacmans[p];
+        const program_t* program = pac->program;
+        *pac = ckpt->pacmans[p];
+        pac->program = program;
+        fit_program_counter(program, &pac->current_move, &pac->current_repeat);
+    }
+    for (int g = 0; g < board->n_ghosts; g++) {
+        ghost_t* ghost = &board->ghosts[g];
+        const program_t* program = ghost->program;
+        *ghost = ckpt->ghosts[g];
+        ghost->program = program;
+        fit_program_counter(program, &ghost->current_move, &ghost->current_repeat);
+    }
+    place_entities(board);
+
+    return 0;
+}
+
+void checkpoint_free(checkpoint_t* ckpt, board_t* board) {
+    if (board && board->checkpoint == ckpt) board->checkpoint = NULL;
+
+    free(ckpt->page_state);
+    free(ckpt->saved);
+    free(ckpt->cells);
+    free(ckpt->pacmans);
+    free(ckpt->ghosts);
+    memset(ckpt, 0, sizeof(*ckpt));
+}
+
+int checkpoint_write_stream(board_t* board, int level, FILE* out) {
+    size_t n_cells = (size_t)board->width * board->height;
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.cell_size = sizeof(board_pos_t);
+    header.level = level;
+    snprintf(header.level_name, sizeof(header.level_name), "%s", board->level_name);
+    header.width = board->width;
+    header.height = board->height;
+    header.n_pacmans = board->n_pacmans;
+    header.n_ghosts = board->n_ghosts;
+
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    for (int p = 0; p < board->n_pacmans && ok; p++) {
+        const pacman_t* pac = &board->pacmans[p];
+        snapshot_entity_t entity = { pac->pos_x, pac->pos_y, pac->alive, pac->points, pac->passo,
+                                     pac->current_move, pac->current_repeat, pac->waiting, 0, pac->rng };
+        ok = fwrite(&entity, sizeof(entity), 1, out) == 1;
+    }
+    for (int g = 0; g < board->n_ghosts && ok; g++) {
+        const ghost_t* ghost = &board->ghosts[g];
+        snapshot_entity_t entity = { ghost->pos_x, ghost->pos_y, 1, 0, ghost->passo,
+                                     ghost->current_move, ghost->current_repeat, ghost->waiting, ghost->charged,
+                                     ghost->rng };
+        ok = fwrite(&entity, sizeof(entity), 1, out) == 1;
+    }
+
+    if (ok) ok = fwrite(board->board, sizeof(board_pos_t), n_cells, out) == n_cells;
+    return ok ? 0 : 1;
+}
+
+// Written to a temporary file next to the snapshot and renamed over it once complete
+int checkpoint_write(board_t* board, int level, const char* filename) {
+    char tmp_path[MAX_FILENAME + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", filename);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) return 1;
+    fchmod(fd, 0644);
+    FILE* out = fdopen(fd, "wb");
+    if (!out) { close(fd); unlink(tmp_path); return 1; }
+
+    int ok = checkpoint_write_stream(board, level, out) == 0;
+    if (ok) ok = fflush(out) == 0 && fsync(fd) == 0;
+    if (fclose(out) != 0) ok = 0;
+    if (ok) ok = rename(tmp_path, filename) == 0;
+    if (!ok) {
+        unlink(tmp_path);
+        return 1;
+    }
+    return 0;
+}
+
+// Whether a regular file still holds 'bytes' after the current position, a pipe is trusted and read as it comes
+static int stream_holds(FILE* in, uint64_t bytes) {
+    struct stat st;
+    if (fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode)) return 1;
+
+    long pos = ftell(in);
+    return pos >= 0 && (uint64_t)st.st_size >= (uint64_t)pos + bytes;
+}
+
+int checkpoint_read_stream(checkpoint_t* ckpt, FILE* in, char level_name[MAX_FILENAME]) {
+    snapshot_header_t header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION || header.cell_size != sizeof(board_pos_t) ||
+        header.width <= 0 || header.height <= 0 || header.n_pacmans < 0 || header.n_ghosts < 0) {
+        return 1;
+    }
+
+    // Cells are indexed with an int and entities must fit an occupancy word, as on a loaded board
+    size_t n_cells = (size_t)header.width * header.height;
+    if (n_cells > INT_MAX || header.n_pacmans > OCC_MAX_ENTITIES || header.n_ghosts > OCC_MAX_ENTITIES) return 1;
+
+    // A truncated or forged file is refused before anything is allocated for it
+    uint64_t body = (uint64_t)(header.n_pacmans + header.n_ghosts) * sizeof(snapshot_entity_t) +
+                    (uint64_t)n_cells * sizeof(board_pos_t);
+    if (!stream_holds(in, body)) return 1;
+
+    memset(ckpt, 0, sizeof(*ckpt));
+    ckpt->level = header.level;
+    ckpt->width = header.width;
+    ckpt->height = header.height;
+    ckpt->n_pages = (int)((n_cells + CHECKPOINT_PAGE_CELLS - 1) / CHECKPOINT_PAGE_CELLS);
+    ckpt->page_state = malloc(ckpt->n_pages * sizeof(uint8_t));
+    ckpt->saved = malloc(ckpt->n_pages * sizeof(int));
+    ckpt->cells = malloc(n_cells * sizeof(board_pos_t));
+    ckpt->n_pacmans = header.n_pacmans;
+    ckpt->pacmans = calloc(header.n_pacmans, sizeof(pacman_t));
+    ckpt->n_ghosts = header.n_ghosts;
+    ckpt->ghosts = calloc(header.n_ghosts, sizeof(ghost_t));
+    ckpt->detached = 1;
+
+    // calloc of zero entities may return NULL, that is not a failure
+    if (!ckpt->page_state || !ckpt->saved || !ckpt->cells ||
+        (header.n_pacmans > 0 && !ckpt->pacmans) || (header.n_ghosts > 0 && !ckpt->ghosts)) {
+        checkpoint_free(ckpt, NULL);
+        return 1;
+    }
+
+    // Every page comes from the file
+    memset(ckpt->page_state, PAGE_SAVED, ckpt->n_pages);
+    for (int page = 0; page < ckpt->n_pages; page++) {
+        ckpt->saved[page] = page;
+    }
+    ckpt->n_saved = ckpt->n_pages;
+
+    int ok = 1;
+    snapshot_entity_t entity;
+    for (int p = 0; p < header.n_pacmans && ok; p++) {
+        ok = fread(&entity, sizeof(entity), 1, in) == 1;
+        if (!ok) break;
+        ckpt->pacmans[p] = (pacman_t){
+            .pos_x = entity.pos_x, .pos_y = entity.pos_y, .alive = entity.alive, .points = entity.points,
+            .passo = entity.passo, .current_move = entity.current_move,
+            .current_repeat = entity.current_repeat, .waiting = entity.waiting, .rng = entity.rng
+        };
+    }
+    for (int g = 0; g < header.n_ghosts && ok; g++) {
+        ok = fread(&entity, sizeof(entity), 1, in) == 1;
+        if (!ok) break;
+        ckpt->ghosts[g] = (ghost_t){
+            .pos_x = entity.pos_x, .pos_y = entity.pos_y, .passo = entity.passo,
+            .current_move = entity.current_move, .current_repeat = entity.current_repeat,
+            .waiting = entity.waiting, .charged = entity.charged, .rng = entity.rng
+        };
+    }
+    if (ok) ok = fread(ckpt->cells, sizeof(board_pos_t), n_cells, in) == n_cells;
+
+    if (!ok) {
+        checkpoint_free(ckpt, NULL);
+        return 1;
+    }
+    header.level_name[MAX_FILENAME - 1] = '\0';
+    memcpy(level_name, header.level_name, MAX_FILENAME);
+    return 0;
+}
+
+int checkpoint_read(checkpoint_t* ckpt, const char* filename, char level_name[MAX_FILENAME]) {
+    FILE* in = fopen(filename, "rb");
+    if (!in) return 1;
+
+    int failed = checkpoint_read_stream(ckpt, in, level_name);
+    fclose(in);
+    return failed;
+}
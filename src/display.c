@@ -1,8 +1,15 @@
 #include "display.h"
 #include "board.h"
 #include <stdlib.h>
-#include <ctype.h>
 
+// Starting row for the game board (leave space for UI)
+#define BOARD_START_ROW 3
+
+// Set when the screen may no longer show the last frame, the next one then repaints every cell
+static int screen_cleared = 1;
+static unsigned char* shown;      // glyph on screen for each cell of the last frame drawn
+static int shown_width, shown_height;
+static unsigned long shown_seq;   // number of the last frame drawn, 0 to compare every cell of the next one
 
 int terminal_init() {
     // Initialize ncurses mode
@@ -39,18 +46,83 @@ int terminal_init() {
 
     // Clear the screen
     clear();
+    screen_cleared = 1;
 
     return 0;
 }
 
 
-void draw_board(board_t* board, int mode) {
-    // Clear the screen before redrawing
-    clear();
+// Draws the glyph of one cell with its colour
+static void draw_glyph(int index, int width, unsigned char glyph) {
+    // Move cursor to position
+    move(BOARD_START_ROW + index / width, index % width);
+
+    // Draw with appropriate color
+    switch (glyph) {
+        case 'W': // Wall
+            attron(COLOR_PAIR(3));
+            addch('#');
+            attroff(COLOR_PAIR(3));
+            break;
+
+        case 'P': // Pacman
+            attron(COLOR_PAIR(1) | A_BOLD);
+            addch('C');
+            attroff(COLOR_PAIR(1) | A_BOLD);
+            break;
+
+        case 'M': // Monster/Ghost
+            attron(COLOR_PAIR(2) | A_BOLD);
+            addch('M');
+            attroff(COLOR_PAIR(2) | A_BOLD);
+            break;
+
+        case GLYPH_CHARGED_GHOST:
+            attron(COLOR_PAIR(2) | A_BOLD | A_DIM);
+            addch('M');
+            attroff(COLOR_PAIR(2) | A_BOLD | A_DIM);
+            break;
+
+        case '@': // Portal
+            attron(COLOR_PAIR(6));
+            addch('@');
+            attroff(COLOR_PAIR(6));
+            break;
+
+        case '.': // Dot
+            attron(COLOR_PAIR(4));
+            addch('.');
+            attroff(COLOR_PAIR(4));
+            break;
+
+        default:
+            addch(glyph);
+            break;
+    }
+}
 
-    // Draw the border/title
+// Draws the points of the level, followed by those of each pacman when there are several
+// A dead pacman's score is marked with an 'x', scores that do not fit the screen are left out
+static void draw_points(int row, int points, const pacman_score_t* scores, int n_pacmans) {
+    mvprintw(row, 0, "Points: %d", points);
+    if (n_pacmans > 1) {
+        for (int p = 0; p < n_pacmans; p++) {
+            char score[32];
+            int len = snprintf(score, sizeof(score), "  P%d %d%s", p + 1, scores[p].points, scores[p].alive ? "" : "x");
+            if (getcurx(stdscr) + len >= COLS) break;
+            addstr(score);
+        }
+    }
+    clrtoeol();
+}
+
+// Draws the title, the status line and the points
+static void draw_status(const char* level_name, int mode, int height, int points, const pacman_score_t* scores,
+                        int n_pacmans) {
     attron(COLOR_PAIR(5));
     mvprintw(0, 0, "=== PACMAN GAME ===");
+    move(1, 0);
+    clrtoeol();
     switch(mode) {
     case DRAW_GAME_OVER:
         mvprintw(1, 0, " GAME OVER ");
@@ -61,80 +133,67 @@ void draw_board(board_t* board, int mode) {
         break;
 
     case DRAW_MENU:
-        mvprintw(1, 0, "Level: %s | Use W/A/S/D to move | Q to quit | G to quicksave ", board->level_name);
+        mvprintw(1, 0, "Level: %s | Use W/A/S/D to move | Q to quit | G to quicksave | U to rewind ", level_name);
         break;
     }
 
+    // Draw score/status at the bottom
+    draw_points(BOARD_START_ROW + height + 1, points, scores, n_pacmans);
+    attroff(COLOR_PAIR(5));
+}
+
+// Paints every cell of the board straight from it, used once the level threads are done
+void draw_board(board_t* board, int mode) {
+    clear();
+    for (int index = 0; index < board->width * board->height; index++) {
+        draw_glyph(index, board->width, cell_glyph(board, index));
+    }
+    pacman_score_t* scores = malloc(board->n_pacmans * sizeof(pacman_score_t));
+    if (scores) {
+        int points = pacman_scores(board, scores);
+        draw_status(board->level_name, mode, board->height, points, scores, board->n_pacmans);
+        free(scores);
+    }
 
-    // Starting row for the game board (leave space for UI)
-    int start_row = 3;
-
-    // Draw the board
-    for (int y = 0; y < board->height; y++) {
-        for (int x = 0; x < board->width; x++) {
-            int index = y * board->width + x;
-            char ch = board->board[index].content;
-            int ghost_charged = 0;
-
-            for (int g = 0; g < board->n_ghosts; g++) {
-                ghost_t* ghost = &board->ghosts[g];
-                if (ghost->pos_x == x && ghost->pos_y == y) {
-                    if (ghost->charged)
-                        ghost_charged = 1;
-                    break;
-                }
-            }
-
-            // Move cursor to position
-            move(start_row + y, x);
-
-            // Draw with appropriate color
-            switch (ch) {
-                case 'W': // Wall
-                    attron(COLOR_PAIR(3));
-                    addch('#');
-                    attroff(COLOR_PAIR(3));
-                    break;
-
-                case 'P': // Pacman
-                    attron(COLOR_PAIR(1) | A_BOLD);
-                    addch('C');
-                    attroff(COLOR_PAIR(1) | A_BOLD);
-                    break;
-
-                case 'M': // Monster/Ghost
-                    attron((COLOR_PAIR(2) | A_BOLD) | ((ghost_charged) ? (A_DIM) : (0)));
-                    addch('M');
-                    attroff((COLOR_PAIR(2) | A_BOLD) | ((ghost_charged) ? (A_DIM) : (0)));
-                    break;
-
-                case ' ': // Empty space
-                    if (board->board[index].has_portal) {
-                        attron(COLOR_PAIR(6));
-                        addch('@');
-                        attroff(COLOR_PAIR(6));
-                    }
-                    else if (board->board[index].has_dot) {
-                        attron(COLOR_PAIR(4));
-                        addch('.');
-                        attroff(COLOR_PAIR(4));
-                    }
-                    else
-                        addch(' ');
-                    break;
-
-                default:
-                    addch(ch);
-                    break;
-            }
+    // The frames drawn next no longer match what is on screen
+    screen_cleared = 1;
+}
+
+// Paints a published frame over the last one, only the cells that changed are drawn
+// Consecutive frames carry their own list of changes, otherwise the frame is compared with what is on screen
+void draw_frame(const frame_t* frame, const char* level_name) {
+    int n_cells = frame->width * frame->height;
+
+    if (screen_cleared || frame->width != shown_width || frame->height != shown_height) {
+        clear();
+        shown = realloc(shown, n_cells);
+        for (int index = 0; index < n_cells; index++) {
+            shown[index] = frame->glyphs[index];
+            draw_glyph(index, frame->width, shown[index]);
+        }
+        screen_cleared = 0;
+        shown_width = frame->width;
+        shown_height = frame->height;
+    } else if (shown_seq != 0 && frame->seq == shown_seq + 1) {
+        for (int c = 0; c < frame->n_changed; c++) {
+            int index = frame->changed[c];
+            shown[index] = frame->glyphs[index];
+            draw_glyph(index, frame->width, shown[index]);
+        }
+    } else {
+        for (int index = 0; index < n_cells; index++) {
+            if (frame->glyphs[index] == shown[index]) continue;
+            shown[index] = frame->glyphs[index];
+            draw_glyph(index, frame->width, shown[index]);
         }
     }
+    shown_seq = frame->seq;
 
-    // Draw score/status at the bottom
-    attron(COLOR_PAIR(5));
-    mvprintw(start_row + board->height + 1, 0, "Points: %d",
-             board->pacmans[0].points); // Assuming first pacman for now
-    attroff(COLOR_PAIR(5));
+    draw_status(level_name, frame->mode, frame->height, frame->points, frame->scores, frame->n_pacmans);
+}
+
+void forget_frames() {
+    shown_seq = 0;
 }
 
 void draw(char c, int colour_i, int pos_x, int pos_y) {
@@ -149,33 +208,9 @@ void refresh_screen() {
     refresh();
 }
 
-char get_input() {
-    // Get a character from the keyboard
-    int ch = getch();
-
-    // getch() returns ERR if no input is available
-    if (ch == ERR) {
-        return '\0'; // No input
-    }
-
-    ch = toupper((char)ch);
-
-    switch ((char)ch) {
-        case 'W':
-        case 'S':
-        case 'A':
-        case 'D':
-        case 'Q':
-        case 'G':
-
-            return (char)ch;
-        
-        default:
-            return '\0';
-    }
-}
-
 void terminal_cleanup() {
     // Restore terminal settings and clean up ncurses
     endwin();
+    // Another process may draw on the terminal before this one resumes
+    screen_cleared = 1;
 }   
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include "frame.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// Set in frame_buffer_t.latest while the reader has not taken the latest frame
+#define FRAME_FRESH 4
+
+// Glyph of one cell, read with relaxed atomics since the movers keep changing the board
+unsigned char cell_glyph(board_t* board, int index) {
+    board_pos_t* cell = &board->board[index];
+    char content = __atomic_load_n(&cell->content, __ATOMIC_RELAXED);
+
+    if (content == 'M') {
+        occupant_t occ = __atomic_load_n(&board->occupancy[index], __ATOMIC_RELAXED);
+        if (occ != OCC_EMPTY && !OCC_IS_PACMAN(occ) && board->ghosts[OCC_INDEX(occ)].charged)
+            return GLYPH_CHARGED_GHOST;
+        return 'M';
+    }
+    if (content != ' ') return (unsigned char)content;
+    if (cell->has_portal) return '@';
+    if (cell->has_dot) return '.';
+    return ' ';
+}
+
+int pacman_scores(board_t* board, pacman_score_t* scores) {
+    int total = 0;
+    for (int p = 0; p < board->n_pacmans; p++) {
+        scores[p].points = __atomic_load_n(&board->pacmans[p].points, __ATOMIC_RELAXED);
+        scores[p].alive = __atomic_load_n(&board->pacmans[p].alive, __ATOMIC_RELAXED) != 0;
+        total += scores[p].points;
+    }
+    return total;
+}
+
+void frame_init(frame_buffer_t* fb, board_t* board, int mode) {
+    int n_cells = board->width * board->height;
+    memset(fb, 0, sizeof(*fb));
+
+    // Everything queued so far is part of the first frame
+    while (next_dirty_cell(board) >= 0) continue;
+
+    for (int f = 0; f < 3; f++) {
+        frame_t* frame = &fb->frames[f];
+        frame->seq = 1;
+        frame->width = board->width;
+        frame->height = board->height;
+        frame->glyphs = malloc(n_cells);
+        frame->changed = malloc(n_cells * sizeof(int));
+        frame->n_pacmans = board->n_pacmans;
+        frame->scores = malloc(board->n_pacmans * sizeof(pacman_score_t));
+        frame->points = pacman_scores(board, frame->scores);
+        frame->mode = mode;
+    }
+    for (int index = 0; index < n_cells; index++) {
+        fb->frames[0].glyphs[index] = cell_glyph(board, index);
+    }
+    memcpy(fb->frames[1].glyphs, fb->frames[0].glyphs, n_cells);
+    memcpy(fb->frames[2].glyphs, fb->frames[0].glyphs, n_cells);
+
+    fb->seq = 1;
+    fb->published = 0;
+    fb->latest = 0 | FRAME_FRESH;
+    fb->back = 1;
+    fb->front = 2;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fb->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&fb->mutex, NULL);
+}
+
+// Copies the cells listed in 'delta' from the latest published frame into the back frame
+static void apply_delta(frame_t* back, const frame_t* delta, const frame_t* latest) {
+    for (int c = 0; c < delta->n_changed; c++) {
+        int index = delta->changed[c];
+        back->glyphs[index] = latest->glyphs[index];
+    }
+}
+
+// Brings the back frame up to the latest published one
+// The frames published since the back frame was last filled are replayed when both are still around
+static void catch_up(frame_buffer_t* fb) {
+    frame_t* back = &fb->frames[fb->back];
+    const frame_t* latest = &fb->frames[fb->published];
+    const frame_t* middle = &fb->frames[3 - fb->back - fb->published];
+
+    if (back->seq == latest->seq) return;
+
+    if (back->seq + 1 == latest->seq) {
+        apply_delta(back, latest, latest);
+    } else if (back->seq + 2 == latest->seq && middle->seq == back->seq + 1) {
+        apply_delta(back, middle, latest);
+        apply_delta(back, latest, latest);
+    } else {
+        memcpy(back->glyphs, latest->glyphs, (size_t)back->width * back->height);
+    }
+}
+
+void frame_publish(frame_buffer_t* fb, board_t* board, int mode, int last) {
+    catch_up(fb);
+
+    frame_t* back = &fb->frames[fb->back];
+    const frame_t* latest = &fb->frames[fb->published];
+    int index;
+
+    back->n_changed = 0;
+    while ((index = next_dirty_cell(board)) >= 0) {
+        unsigned char glyph = cell_glyph(board, index);
+        if (glyph == back->glyphs[index]) continue;
+        back->glyphs[index] = glyph;
+        back->changed[back->n_changed++] = index;
+    }
+    back->points = pacman_scores(board, back->scores);
+    back->mode = mode;
+    back->last = last;
+    int same_scores = memcmp(back->scores, latest->scores, back->n_pacmans * sizeof(pacman_score_t)) == 0;
+
+    // Nothing to show, the reader keeps the frame it has
+    if (back->n_changed == 0 && same_scores && back->mode == latest->mode && !last) {
+        back->seq = latest->seq;
+        return;
+    }
+
+    back->seq = ++fb->seq;
+    int previous = __atomic_exchange_n(&fb->latest, fb->back | FRAME_FRESH, __ATOMIC_ACQ_REL);
+    fb->published = fb->back;
+    fb->back = previous & ~FRAME_FRESH;
+
+    pthread_mutex_lock(&fb->mutex);
+    pthread_cond_signal(&fb->cond);
+    pthread_mutex_unlock(&fb->mutex);
+}
+
+const frame_t* frame_acquire(frame_buffer_t* fb, int timeout_ms) {
+    if (!(__atomic_load_n(&fb->latest, __ATOMIC_ACQUIRE) & FRAME_FRESH)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&fb->mutex);
+        while (!(__atomic_load_n(&fb->latest, __ATOMIC_ACQUIRE) & FRAME_FRESH)) {
+            if (pthread_cond_timedwait(&fb->cond, &fb->mutex, &deadline) == ETIMEDOUT) break;
+        }
+        pthread_mutex_unlock(&fb->mutex);
+
+        if (!(__atomic_load_n(&fb->latest, __ATOMIC_ACQUIRE) & FRAME_FRESH)) return NULL;
+    }
+
+    int taken = __atomic_exchange_n(&fb->latest, fb->front, __ATOMIC_ACQ_REL);
+    fb->front = taken & ~FRAME_FRESH;
+    return &fb->frames[fb->front];
+}
+
+void frame_destroy(frame_buffer_t* fb) {
+    for (int f = 0; f < 3; f++) {
+        free(fb->frames[f].glyphs);
+        free(fb->frames[f].changed);
+        free(fb->frames[f].scores);
+    }
+    pthread_cond_destroy(&fb->cond);
+    pthread_mutex_destroy(&fb->mutex);
+}
@@ -1,5 +1,14 @@
 #include "board.h"
 #include "display.h"
+#include "headless.h"
+#include "level_cache.h"
+#include "scheduler.h"
+#include "frame.h"
+#include "input.h"
+#include "checkpoint.h"
+#include "history.h"
+#include "trace.h"
+#include "metrics.h"
 #include <stdlib.h>
 #include <dirent.h>
 #include <time.h>
@@ -8,14 +17,20 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <errno.h>
 
-#define CONTINUE_PLAY 0
-#define NEXT_LEVEL 1
-#define QUIT_GAME 2
+#define WORKER_RENDER 0
+#define WORKER_DISPLAY 1
+#define WORKER_INPUT 2
+#define WORKER_FIRST_PACMAN 3 // one slot per pacman of the level, then one per ghost
 
+// How far back U rewinds, and how long the game over screen waits for it
+#define REWIND_MS 5000
+#define GAME_OVER_MS 2000
 
 // Safely updates the game outcome (Win/Loss) and notifies waiting threads
 static void set_outcome(game_state_t *state, int outcome) {
@@ -24,17 +39,41 @@ static void set_outcome(game_state_t *state, int outcome) {
     }
     state->running = 0;
     pthread_cond_broadcast(&state->input_cond);
+    sched_stop(state->scheduler);
+    input_stop(state->input);
 }
 
-// Render Thread: Handles screen drawing and captures user input
+// Hands the idle plays an entity counted in 'waiting' to the scheduler, so it sleeps through them in one go
+// Returns the plays until its next action
+static long take_waiting(int *waiting) {
+    long plays = *waiting + 1;
+    *waiting = 0;
+    return plays;
+}
+
+// Sleeps 'plays' on the scheduler for an entity; when the level stops first, the plays it had left go back
+// into 'waiting' so a save, rewind or trace captures the phase it was in
+// Returns 1 if the scheduler was stopped
+static int sleep_plays(game_state_t *state, int slot, long plays, int *waiting) {
+    long left = 0;
+    int stopped = sched_sleep(state->scheduler, slot, plays, &left);
+    if (stopped) *waiting = (int)left;
+    return stopped;
+}
+
+// Render Thread: publishes a frame of the board every play, never touching the terminal
+// A slow terminal therefore only delays the display thread, not the moves
 static void *render_thread(void *arg) {
     game_state_t *state = (game_state_t *)arg;
+    board_t *board = state->board;
 
     while (1) {
         pthread_mutex_lock(&state->mutex);
+        uint64_t held = metrics_now();
         int running = state->running;
         int outcome = state->outcome;
-        board_t *board = state->board;
+        pthread_mutex_unlock(&state->mutex);
+        metrics_record(HIST_STATE_HOLD, metrics_now() - held);
 
         int draw_mode = DRAW_MENU;
         if (outcome == NEXT_LEVEL) {
@@ -43,68 +82,132 @@ static void *render_thread(void *arg) {
             draw_mode = DRAW_GAME_OVER;
         }
 
-        draw_board(board, draw_mode);
-        refresh_screen();
-        pthread_mutex_unlock(&state->mutex);
-
+        uint64_t frame_start = metrics_now();
+        frame_publish(state->frames, board, draw_mode, !running);
+        metrics_record(HIST_FRAME, metrics_now() - frame_start);
+        metrics_count(COUNTER_FRAMES, 1);
         if (!running) break;
+        if (board->history) history_tick(board->history);
+        if (board->trace) trace_tick(board->trace);
 
-        char input = get_input();
-        if (input != '\0') {
-            pthread_mutex_lock(&state->mutex);
-            state->pending_input = input; // Stores input to be used by Pacman thread
-            pthread_cond_broadcast(&state->input_cond);
-            pthread_mutex_unlock(&state->mutex);
-        }
+        // Once the level stops, loop once more to publish its final frame
+        sched_sleep(state->scheduler, WORKER_RENDER, 1, NULL);
+    }
 
-        if (board->tempo != 0) {
-            sleep_ms(board->tempo);
+    return NULL;
+}
+
+// Display Thread: draws the frames the render thread publishes
+// It never takes the game lock while drawing
+static void *display_thread(void *arg) {
+    game_state_t *state = (game_state_t *)arg;
+    board_t *board = state->board;
+    int timeout = (board->tempo > 0) ? board->tempo : 1;
+
+    forget_frames();
+
+    while (1) {
+        const frame_t *frame = frame_acquire(state->frames, timeout);
+        if (frame) {
+            draw_frame(frame, board->level_name);
+            refresh_screen();
+            if (frame->last) break;
         }
     }
 
     return NULL;
 }
 
+// Input Thread: sleeps in poll() on the terminal and queues each key the moment it arrives
+// Keys no longer wait for the display thread to finish a frame before being seen
+static void *input_thread(void *arg) {
+    game_state_t *state = (game_state_t *)arg;
+
+    while (1) {
+        int queued = input_read_keys(state->input, STDIN_FILENO, -1);
+        if (queued < 0) break;
+        if (queued == 0) continue;
+
+        pthread_mutex_lock(&state->mutex);
+        pthread_cond_broadcast(&state->input_cond);
+        pthread_mutex_unlock(&state->mutex);
+    }
+
+    return NULL;
+}
+
 static command_t build_manual_command(char input) {
     command_t cmd;
     cmd.command = input;
     cmd.turns = 1;
-    cmd.turns_left = 1;
     return cmd;
 }
 
-// Pacman Thread: Controls Pacman logic (manual input or auto moves)
+// Scheduler slot of a ghost, the pacmans take the slots before the ghosts
+static int ghost_slot(const board_t *board, int ghost_index) {
+    return WORKER_FIRST_PACMAN + board->n_pacmans + ghost_index;
+}
+
+// The first pacman without a script reads the keyboard, -1 when every pacman has one
+static int keyboard_pacman(const board_t *board) {
+    for (int p = 0; p < board->n_pacmans; p++) {
+        if (board->pacmans[p].program == NULL) return p;
+    }
+    return -1;
+}
+
+// Ends the level when a move killed the last pacman standing, the others play on after one of them dies
+// Must be called with state->mutex held
+static void check_pacmans_left(game_state_t *state) {
+    if (pacmans_alive(state->board) == 0) set_outcome(state, QUIT_GAME);
+}
+
+// Pacman Thread: plays one pacman, from its script, from the keyboard or, for any other pacman
+// without a script, with random moves as in a headless run
 static void *pacman_thread(void *arg) {
-    game_state_t *state = (game_state_t *)arg;
+    pacman_thread_args_t *pacman_args = (pacman_thread_args_t *)arg;
+    game_state_t *state = pacman_args->state;
+    int pacman_index = pacman_args->pacman_index;
+    int slot = WORKER_FIRST_PACMAN + pacman_index;
     board_t *board = state->board;
+    pacman_t *pacman = &board->pacmans[pacman_index];
 
     command_t manual_cmd; 
+    command_t random_cmd = { .command = 'R', .turns = 1 };
+    keypress_t key;
+    int keyboard = (pacman_index == keyboard_pacman(board));
+
+    // Sleep through the initial PASSO before the first play
+    long plays = pacman->waiting;
+    pacman->waiting = 0;
+    sleep_plays(state, slot, plays, &pacman->waiting);
 
     while (1) {
+        // The keyboard stays read after its pacman died, Q, G and U still work while the others play on
         pthread_mutex_lock(&state->mutex);
-        if (!state->running) {
+        int alive = __atomic_load_n(&pacman->alive, __ATOMIC_ACQUIRE);
+        if (!state->running || (!alive && !keyboard)) {
             pthread_mutex_unlock(&state->mutex);
             break;
         }
 
-        pacman_t *pacman = &board->pacmans[0];
-        command_t *cmd_ptr;
+        const command_t *cmd_ptr;
 
-        // If no predefined moves, wait for user input from Render Thread
-        if (pacman->n_moves == 0) {
-            while (state->pending_input == '\0' && state->running) {
+        // If no predefined moves, wait for the next key from the Input Thread
+        if (keyboard) {
+            while (!input_pop(state->input, &key) && state->running) {
                 pthread_cond_wait(&state->input_cond, &state->mutex);
             }
             if (!state->running) {
                 pthread_mutex_unlock(&state->mutex);
                 break;
             }
-            manual_cmd = build_manual_command(state->pending_input);
-            state->pending_input = '\0';
+            manual_cmd = build_manual_command(key.key);
             cmd_ptr = &manual_cmd;
+        } else if (pacman->program == NULL) {
+            cmd_ptr = &random_cmd;
         } else {
-            int cmd_index = pacman->current_move % pacman->n_moves;
-            cmd_ptr = &pacman->moves[cmd_index];
+            cmd_ptr = &pacman->program->ops[pacman->current_move];
         }
 
         pthread_mutex_unlock(&state->mutex);
@@ -113,6 +216,17 @@ static void *pacman_thread(void *arg) {
             pthread_mutex_lock(&state->mutex);
             set_outcome(state, QUIT_GAME);
             pthread_mutex_unlock(&state->mutex);
+            sched_sleep(state->scheduler, slot, 1, NULL);
+            continue;
+        }
+
+        // Rewinding happens once every thread stopped, like a quick save
+        if (cmd_ptr->command == 'U') {
+            pthread_mutex_lock(&state->mutex);
+            state->rewind_request = 1;
+            set_outcome(state, CONTINUE_PLAY);
+            pthread_mutex_unlock(&state->mutex);
+            sched_sleep(state->scheduler, slot, 1, NULL);
             continue;
         }
 
@@ -125,6 +239,7 @@ static void *pacman_thread(void *arg) {
                 set_outcome(state, CONTINUE_PLAY);
             }
             pthread_mutex_unlock(&state->mutex);
+            sched_sleep(state->scheduler, slot, 1, NULL);
             continue;
         }
 
@@ -132,84 +247,403 @@ static void *pacman_thread(void *arg) {
         int is_running = state->running;
         pthread_mutex_unlock(&state->mutex);
         if (!is_running) break;
+        if (!alive) continue;
         
-        int result = move_pacman(board, 0, cmd_ptr); 
+        int result = move_pacman(board, pacman_index, cmd_ptr); 
+        if (keyboard) input_played(state->input, &key);
         
+        // Any pacman reaching the portal clears the level for all of them
         if (result == REACHED_PORTAL || result == DEAD_PACMAN) {
             pthread_mutex_lock(&state->mutex);
             if (result == REACHED_PORTAL) {
                 set_outcome(state, NEXT_LEVEL);
             } else if (result == DEAD_PACMAN) {
-                set_outcome(state, QUIT_GAME);
+                check_pacmans_left(state);
             }
             pthread_mutex_unlock(&state->mutex);
         }
 
-        if (board->tempo != 0) {
-            sleep_ms(board->tempo);
-        }
+        sleep_plays(state, slot, take_waiting(&pacman->waiting), &pacman->waiting);
     }
 
     return NULL;
 }
 
 // Ghost Thread: Manages the movement of a single ghost
+// The ghost only wakes when the scheduler says its next move is due, ghosts without moves never wake
 static void *ghost_thread(void *arg) {
     ghost_thread_args_t *ghost_args = (ghost_thread_args_t *)arg;
     game_state_t *state = ghost_args->state;
     int ghost_index = ghost_args->ghost_index;
     board_t *board = state->board;
+    int slot = ghost_slot(board, ghost_index);
+    ghost_t *ghost = &board->ghosts[ghost_index];
 
-    while (1) {
-        pthread_mutex_lock(&state->mutex);
-        if (!state->running) {
-            pthread_mutex_unlock(&state->mutex);
-            break;
-        }
+    if (ghost->program == NULL) return NULL;
 
-        ghost_t *ghost = &board->ghosts[ghost_index];
-        if (ghost->n_moves == 0) {
-            pthread_mutex_unlock(&state->mutex);
-            if (board->tempo != 0) {
-                sleep_ms(board->tempo);
-            }
-            continue;
-        }
-
-        int cmd_index = ghost->current_move % ghost->n_moves;
-        command_t *cmd_ptr = &ghost->moves[cmd_index]; 
-        
-        pthread_mutex_unlock(&state->mutex);
+    // Sleep through the initial PASSO before the first move
+    long plays = ghost->waiting;
+    ghost->waiting = 0;
 
+    while (sleep_plays(state, slot, plays, &ghost->waiting) == 0) {
         pthread_mutex_lock(&state->mutex);
         int is_running = state->running;
         pthread_mutex_unlock(&state->mutex);
         if (!is_running) break;
 
+        const command_t *cmd_ptr = &ghost->program->ops[ghost->current_move];
         int result = move_ghost(board, ghost_index, cmd_ptr);
         
         if (result == DEAD_PACMAN) {
             pthread_mutex_lock(&state->mutex);
-            set_outcome(state, QUIT_GAME);
+            check_pacmans_left(state);
             pthread_mutex_unlock(&state->mutex);
         }
 
-        if (board->tempo != 0) {
-            sleep_ms(board->tempo);
+        plays = take_waiting(&ghost->waiting);
+    }
+
+    return NULL;
+}
+
+struct worker_pool;
+
+// Arguments of a pooled worker, its slot decides which role it plays
+typedef struct {
+    struct worker_pool *pool;  // Pool owning this worker
+    int slot;                  // WORKER_RENDER, WORKER_DISPLAY, WORKER_INPUT or WORKER_FIRST_PACMAN + entity
+    unsigned long seen;        // Last level generation this worker played
+    pacman_thread_args_t pacman; // Arguments handed to pacman_thread
+    ghost_thread_args_t ghost; // Arguments handed to ghost_thread
+} worker_args_t;
+
+// Long lived threads that are handed every new level instead of being recreated
+typedef struct worker_pool {
+    pthread_mutex_t mutex;     // Protects every field below
+    pthread_cond_t start_cond; // Signalled when a new level starts
+    pthread_cond_t done_cond;  // Signalled when the last worker finishes a level
+    game_state_t *state;       // State of the level currently being played
+    unsigned long generation;  // Incremented on each level start
+    int active;                // Workers still playing the current generation
+    int shutdown;              // Flag telling the workers to exit
+    pthread_t *tids;           // Worker threads
+    worker_args_t **args;      // Arguments of each worker
+    int n_workers;             // Number of running workers
+} worker_pool_t;
+
+// Worker Thread: waits for a level, plays its role on it and waits again
+static void *worker_thread(void *arg) {
+    worker_args_t *args = (worker_args_t *)arg;
+    worker_pool_t *pool = args->pool;
+
+    // The entity slots play a pacman or a ghost depending on the level, they are named once they know which
+    static const char *roles[] = { "render", "display", "input" };
+    char name[32];
+    if (args->slot < WORKER_FIRST_PACMAN) metrics_name_thread(roles[args->slot]);
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->generation == args->seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        args->seen = pool->generation;
+        game_state_t *state = pool->state;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (args->slot == WORKER_RENDER) {
+            render_thread(state);
+        } else if (args->slot == WORKER_DISPLAY) {
+            display_thread(state);
+        } else if (args->slot == WORKER_INPUT) {
+            input_thread(state);
+        } else if (args->slot - WORKER_FIRST_PACMAN < state->board->n_pacmans) {
+            args->pacman.state = state;
+            args->pacman.pacman_index = args->slot - WORKER_FIRST_PACMAN;
+            snprintf(name, sizeof(name), "pacman %d", args->pacman.pacman_index);
+            metrics_name_thread(name);
+            pacman_thread(&args->pacman);
+        } else if (args->slot - WORKER_FIRST_PACMAN - state->board->n_pacmans < state->board->n_ghosts) {
+            args->ghost.state = state;
+            args->ghost.ghost_index = args->slot - WORKER_FIRST_PACMAN - state->board->n_pacmans;
+            snprintf(name, sizeof(name), "ghost %d", args->ghost.ghost_index);
+            metrics_name_thread(name);
+            ghost_thread(&args->ghost);
         }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->active--;
+        if (pool->active == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+        pthread_mutex_unlock(&pool->mutex);
     }
 
     return NULL;
 }
 
+static void pool_init(worker_pool_t *pool) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+}
+
+// Spawns workers until there is one for the renderer, the display, the input and each of 'n_entities' pacmans and ghosts
+// Must be called with pool->mutex held
+static void pool_grow(worker_pool_t *pool, int n_entities) {
+    int needed = WORKER_FIRST_PACMAN + n_entities;
+    if (needed <= pool->n_workers) return;
+
+    pool->tids = realloc(pool->tids, needed * sizeof(pthread_t));
+    pool->args = realloc(pool->args, needed * sizeof(worker_args_t *));
+
+    while (pool->n_workers < needed) {
+        worker_args_t *args = calloc(1, sizeof(worker_args_t));
+        args->pool = pool;
+        args->slot = pool->n_workers;
+        args->seen = pool->generation;
+        pool->args[pool->n_workers] = args;
+        pthread_create(&pool->tids[pool->n_workers], NULL, worker_thread, args);
+        pool->n_workers++;
+    }
+}
+
+// Hands a level to the workers and blocks until every one of them is done with it
+static void pool_run_level(worker_pool_t *pool, game_state_t *state) {
+    pthread_mutex_lock(&pool->mutex);
+    pool_grow(pool, state->board->n_pacmans + state->board->n_ghosts);
+
+    pool->state = state;
+    pool->active = pool->n_workers;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pool->state = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Wakes every worker up, waits for them to exit and frees the pool
+static void pool_destroy(worker_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int w = 0; w < pool->n_workers; w++) {
+        pthread_join(pool->tids[w], NULL);
+        free(pool->args[w]);
+    }
+    free(pool->tids);
+    free(pool->args);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
+
+// Next level being loaded on a background thread while the current one plays
+typedef struct {
+    pthread_t tid;         // Loader thread
+    int started;           // A load was started and its thread was not joined yet
+    int ready;             // 'board' holds a loaded level that was not handed out yet
+    int index;             // Position of the level being loaded in the level list
+    int result;            // Return value of load_level_cached
+    const char *filename;  // Level file being loaded
+    board_t board;         // Level loaded by the thread
+} level_preload_t;
+
+static void *preload_thread(void *arg) {
+    level_preload_t *preload = (level_preload_t *)arg;
+    preload->result = load_level_cached(&preload->board, preload->filename, 0);
+    return NULL;
+}
+
+// Starts loading level 'index' in the background
+static void preload_start(level_preload_t *preload, char lista[][MAX_FILENAME], int index) {
+    memset(preload, 0, sizeof(*preload));
+    preload->index = index;
+    preload->filename = lista[index];
+    if (pthread_create(&preload->tid, NULL, preload_thread, preload) == 0) {
+        preload->started = 1;
+    }
+}
+
+// Waits for the loader thread, fork() must not be called while it is still running
+static void preload_wait(level_preload_t *preload) {
+    if (!preload->started) return;
+    pthread_join(preload->tid, NULL);
+    preload->started = 0;
+    preload->ready = (preload->result == 0);
+}
+
+// Moves the preloaded level into 'board' if it is level 'index', returns 0 on success
+// The level was loaded before the points of the previous one were known, so they are given to its first pacman here
+static int preload_take(level_preload_t *preload, int index, board_t *board, int points) {
+    preload_wait(preload);
+    if (!preload->ready || preload->index != index) return 1;
+
+    *board = preload->board;
+    preload->ready = 0;
+    board->pacmans[0].points = points;
+    return 0;
+}
+
+// Waits for the loader thread and frees a level that will not be played
+static void preload_discard(level_preload_t *preload) {
+    preload_wait(preload);
+    if (preload->ready) {
+        unload_level(&preload->board);
+        preload->ready = 0;
+    }
+}
+
+// Plays per rewind, at least one
+static unsigned long rewind_ticks(const board_t *board) {
+    return (board->tempo > 0) ? (unsigned long)(REWIND_MS / board->tempo) + 1 : 1;
+}
+
+// Undoes the last REWIND_MS of the level from its rewind ring
+static void rewind_level(history_t *history, board_t *board) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long undone = history_rewind(history, board, rewind_ticks(board));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    log_info("Rewound %s by %lu plays in %.3f ms\n", board->level_name, undone,
+          (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+// Shows the game over screen for GAME_OVER_MS, returns 1 if the player pressed U to rewind meanwhile
+static int wait_for_rewind(void) {
+    input_queue_t input;
+    if (input_init(&input) != 0) {
+        sleep_ms(GAME_OVER_MS);
+        return 0;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rewind = 0;
+
+    while (!rewind) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= GAME_OVER_MS) break;
+        if (input_read_keys(&input, STDIN_FILENO, (int)(GAME_OVER_MS - elapsed)) < 0) break;
+
+        keypress_t key;
+        while (input_pop(&input, &key)) {
+            if (key.key == 'U') rewind = 1;
+        }
+    }
+
+    input_destroy(&input);
+    return rewind;
+}
+
+// Puts the level back as it was at the quick save and drops the save, so a new one can be taken
+static void restore_quick_save(checkpoint_t *checkpoint, board_t *board) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = checkpoint_restore(checkpoint, board);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (failed) {
+        log_warn("Quick save does not fit %s anymore, playing it from the start\n", board->level_name);
+    } else {
+        log_info("Restored the quick save of %s in %.3f ms (%d of %d pages copied back)\n", board->level_name,
+              (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+              checkpoint->n_saved, checkpoint->n_pages);
+    }
+    checkpoint_free(checkpoint, board);
+    board->save_active = 0;
+}
+
+// Quick saves copied to disk by a forked child while the game goes on, at most one child writes at a time
+typedef struct {
+    char filename[PATH_MAX];  // snapshot file, empty when quick saves stay in memory
+    pid_t pid;                // child writing the last save, 0 when there is none
+} bgsave_t;
+
+// Collects the child of the last background save, waiting for it only when 'block' is set
+static void bgsave_reap(bgsave_t *bgsave, int block) {
+    if (bgsave->pid <= 0) return;
+
+    int status;
+    pid_t done = waitpid(bgsave->pid, &status, block ? 0 : WNOHANG);
+    if (done == 0) return;
+
+    if (done == bgsave->pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        log_info("Background save to %s finished\n", bgsave->filename);
+    } else {
+        log_error("Background save to %s failed\n", bgsave->filename);
+    }
+    bgsave->pid = 0;
+}
+
+// Forks a child that writes the board to the snapshot file, the child only sees the board as it is right now
+// Must be called while no level thread moves; the child only touches the board and its own file, so a
+// level still loading in the background does not have to finish first
+// A save taken while the last child still writes stays in memory only, the game never waits for the disk
+static void bgsave_start(bgsave_t *bgsave, board_t *board, int level) {
+    if (bgsave->filename[0] == '\0') return;
+    bgsave_reap(bgsave, 0);
+    if (bgsave->pid > 0) {
+        log_warn("Background save to %s still running, quick save of %s kept in memory only\n",
+                 bgsave->filename, board->level_name);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // _exit keeps the child from flushing the parent's buffered output or touching the terminal
+        _exit(checkpoint_write(board, level, bgsave->filename) == 0 ? 0 : 1);
+    }
+    if (pid < 0) {
+        log_error("Could not start a background save: %s\n", strerror(errno));
+        return;
+    }
+    bgsave->pid = pid;
+}
+
+// Makes a path from the command line absolute, main changes into the level directory before using it
+static void absolute_path(const char *path, char out[PATH_MAX]) {
+    char cwd[PATH_MAX];
+    if (path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL) {
+        snprintf(out, PATH_MAX, "%s", path);
+    } else {
+        snprintf(out, PATH_MAX, "%.*s/%s", PATH_MAX / 2, cwd, path);
+    }
+}
+
 int has_extension(const char *filename, const char *ext) {
     const char *dot = strrchr(filename, '.');
     if (!dot || dot == filename) return 0;
     return (strcmp(dot, ext) == 0);
 }
 
-// Scans the directory for valid level files (.lvl)
-int find_levels(const char *dirpath, char lista[MAX_LEVELS][MAX_FILENAME]) {
+// Orders level names by their leading number first, so 10.lvl comes after 9.lvl
+static int compare_levels(const void *a, const void *b) {
+    const char *name_a = (const char *)a;
+    const char *name_b = (const char *)b;
+    long num_a = strtol(name_a, NULL, 10);
+    long num_b = strtol(name_b, NULL, 10);
+
+    if (num_a != num_b) return (num_a < num_b) ? -1 : 1;
+    return strcmp(name_a, name_b);
+}
+
+// Scans the directory for valid level files (.lvl), the list grows as needed and is returned sorted
+int find_levels(const char *dirpath, char (**lista)[MAX_FILENAME]) {
+    *lista = NULL;
+
     DIR *dirp = opendir(dirpath);
     if (dirp == NULL) {
         perror("Error opening directory");
@@ -218,146 +652,267 @@ int find_levels(const char *dirpath, char lista[MAX_LEVELS][MAX_FILENAME]) {
 
     struct dirent *dp;
     int count = 0;
+    int capacity = 0;
 
     while ((dp = readdir(dirp)) != NULL) {
         
         if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
             continue;
 
-        if (has_extension(dp->d_name, ".lvl") && count < MAX_LEVELS) {
-            strncpy(lista[count], dp->d_name, MAX_FILENAME - 1);
-            lista[count][MAX_FILENAME - 1] = '\0';
+        if (has_extension(dp->d_name, ".lvl")) {
+            if (count == capacity) {
+                int grown = (capacity > 0) ? capacity * 2 : 16;
+                char (*bigger)[MAX_FILENAME] = realloc(*lista, grown * sizeof(**lista));
+                // Out of memory, play the levels found so far
+                if (bigger == NULL) {
+                    perror("Error listing levels");
+                    break;
+                }
+                *lista = bigger;
+                capacity = grown;
+            }
+            strncpy((*lista)[count], dp->d_name, MAX_FILENAME - 1);
+            (*lista)[count][MAX_FILENAME - 1] = '\0';
             count++;
         }
     }
     closedir(dirp);
+
+    if (count > 1) qsort(*lista, count, sizeof(**lista), compare_levels);
     
     return count;
 }
 
 // Main Game Loop: Handles initialization, level loading, threads, and save/restore
 int main(int argc, char** argv) {
-    if (argc != 2) {    
-        fprintf(stderr, "Usage: %s <level_directory>\n", argv[0]);
+    const char *level_dir = NULL;
+    int headless = 0;
+    headless_options_t options = { .max_ticks = 100000, .seed = 1, .lockfree = 0, .batch = 0 };
+    bgsave_t bgsave = {0};
+    char resume_file[PATH_MAX] = "";
+    char trace_file[PATH_MAX] = "";
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--headless") == 0) {
+            headless = 1;
+        } else if (strcmp(argv[a], "--lockfree") == 0) {
+            options.lockfree = 1;
+        } else if (strcmp(argv[a], "--ticks") == 0 && a + 1 < argc) {
+            options.max_ticks = strtol(argv[++a], NULL, 10);
+        } else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc) {
+            // A batch only makes sense without a terminal
+            headless = 1;
+            options.batch = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            options.seed = (unsigned int)strtoul(argv[++a], NULL, 10);
+        } else if (strcmp(argv[a], "--save-file") == 0 && a + 1 < argc) {
+            absolute_path(argv[++a], bgsave.filename);
+        } else if (strcmp(argv[a], "--resume") == 0 && a + 1 < argc) {
+            absolute_path(argv[++a], resume_file);
+        } else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+            absolute_path(argv[++a], trace_file);
+        } else if (level_dir == NULL && argv[a][0] != '-') {
+            level_dir = argv[a];
+        } else {
+            level_dir = NULL;
+            break;
+        }
+    }
+
+    if (level_dir == NULL || options.max_ticks <= 0 || options.batch < 0) {
+        fprintf(stderr, "Usage: %s <level_directory> [--lockfree] [[--save-file F] [--resume F] [--trace F] | --headless [--ticks N] [--seed S] [--batch N]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    // Headless runs count waits down inside the moves and take no quick saves, so neither a trace
+    // nor a snapshot of them would match the live game the replay tool and --resume expect
+    if (headless && (trace_file[0] != '\0' || bgsave.filename[0] != '\0' || resume_file[0] != '\0')) {
+        fprintf(stderr, "Usage: --trace, --save-file and --resume need a live game, they cannot be used with --headless or --batch\n");
         return 1;
     }
 
-    if (chdir(argv[1]) != 0) {
+    char level_path[PATH_MAX];
+    absolute_path(level_dir, level_path);
+
+    if (chdir(level_dir) != 0) {
         perror("Error changing directory");
         return 1;
     }
 
-    srand((unsigned int)time(NULL));
+    char (*lista_niveis)[MAX_FILENAME];
+    int n_niveis = find_levels(".", &lista_niveis);
+
+    // Before any other thread exists, so that only the dumper ever takes SIGUSR1
+    if (metrics_start("stats.json") != 0) {
+        fprintf(stderr, "Warning: metrics are not dumped on SIGUSR1\n");
+    }
+    metrics_name_thread("main");
+
+    if (headless) {
+        open_debug_file("debug.log");
+        if (options.batch > 0) run_batch(lista_niveis, n_niveis, &options);
+        else run_headless(lista_niveis, n_niveis, &options);
+        close_debug_file();
+        metrics_stop();
+        free(lista_niveis);
+        return 0;
+    }
+
+    // Quick save, it follows the level it was taken on until that level is left
+    checkpoint_t checkpoint = {0};
+    int restore_pending = 0;
+    int first_level = 0;
+
+    // A snapshot written by --save-file continues the game from its level
+    if (resume_file[0] != '\0') {
+        char level_name[MAX_FILENAME];
+        if (checkpoint_read(&checkpoint, resume_file, level_name) != 0) {
+            fprintf(stderr, "Error resuming: %s is not a readable save\n", resume_file);
+            free(lista_niveis);
+            return 1;
+        }
+        first_level = -1;
+        for (int l = 0; l < n_niveis; l++) {
+            if (strcmp(lista_niveis[l], level_name) == 0) first_level = l;
+        }
+        if (first_level < 0) {
+            fprintf(stderr, "Error resuming: level %s of %s is gone\n", level_name, resume_file);
+            checkpoint_free(&checkpoint, NULL);
+            free(lista_niveis);
+            return 1;
+        }
+        checkpoint.level = first_level;
+        restore_pending = 1;
+    }
+
+    // Every move of the session, to be checked later with the replay tool
+    trace_t trace = {0};
+    int tracing = 0;
+    if (trace_file[0] != '\0') {
+        if (trace_open(&trace, trace_file, level_path, options.lockfree) != 0) {
+            fprintf(stderr, "Error creating trace %s\n", trace_file);
+            checkpoint_free(&checkpoint, NULL);
+            free(lista_niveis);
+            return 1;
+        }
+        tracing = 1;
+    }
+
+    unsigned int seed = (unsigned int)time(NULL);
     open_debug_file("debug.log");
     terminal_init();
-    
-    char lista_niveis[MAX_LEVELS][MAX_FILENAME];
-    int n_niveis = find_levels(".", lista_niveis);
 
     int accumulated_points = 0;
     bool game_over = false;
 
     int global_save_active = 0;
+    int input_error = 0;
+
+    worker_pool_t pool;
+    pool_init(&pool);
 
-    for (int i = 0; i < n_niveis; i++) {
+    level_preload_t preload = {0};
+
+    for (int i = first_level; i < n_niveis; i++) {
         if (game_over) break;
 
         board_t game_board = {0};
 
-        game_board.save_active = global_save_active;
-
-        if (load_level_filename(&game_board, lista_niveis[i], accumulated_points) != 0) {
-             debug("Failed to load level: %s\n", lista_niveis[i]);
+        if (preload_take(&preload, i, &game_board, accumulated_points) != 0 &&
+            load_level_cached(&game_board, lista_niveis[i], accumulated_points) != 0) {
+             log_error("Failed to load level: %s\n", lista_niveis[i]);
              continue;
         }
 
+        game_board.save_active = global_save_active;
         strncpy(game_board.level_name, lista_niveis[i], 255);
-        
+        if (options.lockfree) enable_lockfree_moves(&game_board);
+        enable_dirty_tracking(&game_board);
+        seed_random_moves(&game_board, seed + i);
+
+        // Died on a later level with the quick save taken on this one, or resuming from a snapshot file
+        if (restore_pending) {
+            restore_quick_save(&checkpoint, &game_board);
+            restore_pending = 0;
+            global_save_active = 0;
+        }
+
+        // Every change from here on can be rewound, as far back as the ring reaches
+        history_t history;
+        history_init(&history, HISTORY_RECORDS);
+        game_board.history = &history;
+
+        // Load the next level while this one is played, so it is ready when the portal is reached
+        if (i + 1 < n_niveis) preload_start(&preload, lista_niveis, i + 1);
+
         int repeat_level = 1;
         while (repeat_level) {
             repeat_level = 0;
 
+            // One sleeper per pooled role: renderer, display, input, each pacman and each ghost
+            scheduler_t scheduler;
+            sched_init(&scheduler, game_board.tempo, WORKER_FIRST_PACMAN + game_board.n_pacmans + game_board.n_ghosts);
+
+            frame_buffer_t frames;
+            frame_init(&frames, &game_board, DRAW_MENU);
+
+            // Leave the level loop like the end of the game, so the pool and the preload thread are joined
+            // and the terminal is restored before the error is printed
+            input_queue_t input;
+            if (input_init(&input) != 0) {
+                input_error = errno;
+                log_error("Error creating input queue: %s\n", strerror(input_error));
+                sched_destroy(&scheduler);
+                frame_destroy(&frames);
+                game_over = true;
+                break;
+            }
+
             game_state_t state = {
                 .board = &game_board,
                 .running = 1,
                 .outcome = CONTINUE_PLAY,
-                .pending_input = '\0',
-                .save_request = 0
+                .save_request = 0,
+                .rewind_request = 0,
+                .scheduler = &scheduler,
+                .frames = &frames,
+                .input = &input
             };
 
             pthread_mutex_init(&state.mutex, NULL);
             pthread_cond_init(&state.input_cond, NULL);
 
-            pthread_t render_tid;
-            pthread_t pacman_tid;
-            pthread_t ghost_tids[MAX_GHOSTS];
-            ghost_thread_args_t ghost_args[MAX_GHOSTS];
-
-            // Start Threads
-            pthread_create(&render_tid, NULL, render_thread, &state);
-            pthread_create(&pacman_tid, NULL, pacman_thread, &state);
-
-            for (int g = 0; g < game_board.n_ghosts; g++) {
-                ghost_args[g].state = &state;
-                ghost_args[g].ghost_index = g;
-                pthread_create(&ghost_tids[g], NULL, ghost_thread, &ghost_args[g]);
-            }
-
-            // Join Threads
-            pthread_join(pacman_tid, NULL);
-            for (int g = 0; g < game_board.n_ghosts; g++) {
-                pthread_join(ghost_tids[g], NULL);
-            }
-            pthread_join(render_tid, NULL);
+            // Play the level on the pooled threads
+            if (tracing && trace_begin(&trace, &game_board, i) != 0) log_error("Could not write to the trace\n");
+            pool_run_level(&pool, &state);
+            if (tracing && trace_end(&trace, &game_board) != 0) log_error("Could not write to the trace\n");
 
             pthread_mutex_destroy(&state.mutex);
             pthread_cond_destroy(&state.input_cond);
+            sched_destroy(&scheduler);
+            frame_destroy(&frames);
 
-            // Handle Save Game Request (Fork logic)
+            if (input.n_moves > 0) {
+                log_info("Input: %ld keys played, key-to-move latency avg %.2f ms, max %.2f ms, %ld dropped\n",
+                      input.n_moves, input.total_ms / input.n_moves, input.max_ms, input.dropped);
+            }
+            input_destroy(&input);
+
+            // Take the quick save while no thread plays, then carry on with the same level
+            // With --save-file a child copies it to disk meanwhile
             if (state.save_request) {
-                terminal_cleanup();
-                pid_t pid = fork();
-
-                if (pid < 0) {
-                    perror("Error saving game");
-                    game_board.save_active = 0;
-                    continue;
-                } else if (pid > 0) {
-                    // Parent process waits for child
-                    int status;
-                    while (1) {
-                        waitpid(pid, &status, 0);
-
-                        if (WIFEXITED(status)) {
-                            // Exit code 67 indicates Pacman died with an active save -> Restore (Fork again)
-                            if (WEXITSTATUS(status) == 67) {
-                                pid_t new_pid = fork();
-                                if (new_pid == 0) {
-                                    break; // Child (restored game) breaks loop to continue playing
-                                } else if (new_pid > 0) {
-                                    pid = new_pid; // Parent updates pid and waits again
-                                } else {
-                                    perror("Error restoring game");
-                                    exit(1);
-                                }
-                            } else {
-                                exit(WEXITSTATUS(status));
-                            }
-                        } else {
-                            exit(1);
-                        }
-                    }
+                checkpoint_take(&checkpoint, &game_board, i);
+                log_info("Quick save of %s taken\n", game_board.level_name);
+                bgsave_start(&bgsave, &game_board, i);
+                repeat_level = 1;
+                continue;
+            }
 
-                    game_board.save_active = 0;
-                    repeat_level = 1;
-                    continue;
-                } else {
-                    // Child process continues the game
-                    terminal_init();
-                    game_board.save_active = 1;
-                    repeat_level = 1;
-                    continue;
-                }
+            if (state.rewind_request) {
+                rewind_level(&history, &game_board);
+                repeat_level = 1;
+                continue;
             }
 
             if (game_board.save_active) {
@@ -368,18 +923,30 @@ int main(int argc, char** argv) {
             if (state.outcome == NEXT_LEVEL) {
                 sleep_ms(game_board.tempo);
             } else if (state.outcome == QUIT_GAME) {
-                sleep_ms(2000);
+                // A death without a quick save can be taken back while the game over screen shows
+                if (pacmans_alive(&game_board) == 0 && !game_board.save_active) {
+                    if (wait_for_rewind()) {
+                        rewind_level(&history, &game_board);
+                        repeat_level = 1;
+                        continue;
+                    }
+                } else {
+                    sleep_ms(GAME_OVER_MS);
+                }
                 game_over = true;
 
-                if (game_board.save_active) {
-                    if (!game_board.pacmans[0].alive) {
-                        close_debug_file();
-                        exit(67); // Special exit code for "Death with Save"
-                    } else {
-                        terminal_cleanup();
-                        close_debug_file();
-                        exit(0);
+                // Dying with a quick save goes back to it instead of ending the game
+                if (game_board.save_active && pacmans_alive(&game_board) == 0) {
+                    game_over = false;
+                    global_save_active = 0;
+                    if (checkpoint.level == i) {
+                        restore_quick_save(&checkpoint, &game_board);
+                        history_clear(&history);
+                        repeat_level = 1;
+                        continue;
                     }
+                    restore_pending = 1;
+                    break;
                 }
             }
 
@@ -395,12 +962,36 @@ int main(int argc, char** argv) {
             repeat_level = 0;
         }
 
-        accumulated_points = game_board.pacmans[0].points;      
+        bgsave_reap(&bgsave, 0);
+        accumulated_points = pacmans_points(&game_board);
+        if (game_board.checkpoint) checkpoint_detach(&checkpoint, &game_board);
+        game_board.history = NULL;
+        history_free(&history);
         unload_level(&game_board);
+
+        // The quick save was taken on an earlier level, play again from there
+        if (restore_pending) {
+            preload_discard(&preload);
+            i = checkpoint.level - 1;
+        }
     }
 
+    bgsave_reap(&bgsave, 1);
+    if (tracing) {
+        log_info("Trace: %lu segment(s), %lu events written to %s\n", trace.segments, trace.events, trace_file);
+        trace_close(&trace);
+    }
+    checkpoint_free(&checkpoint, NULL);
+    preload_discard(&preload);
+    pool_destroy(&pool);
+    free(lista_niveis);
     terminal_cleanup();
     close_debug_file();
+    metrics_stop();
 
+    if (input_error) {
+        fprintf(stderr, "Error creating input queue: %s\n", strerror(input_error));
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,357 @@
+#include "headless.h"
+#include "level_cache.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Death cells listed for each level of a batch report, the ones most pacmans died on
+#define BATCH_TOP_DEATHS 5
+
+// Seconds elapsed since 'start' on the monotonic clock
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Plays one pacman for the current tick, returns the level outcome it causes
+static int step_pacman(board_t *board, int pacman_index) {
+    pacman_t *pacman = &board->pacmans[pacman_index];
+    if (!pacman->alive) return CONTINUE_PLAY;
+
+    // Without a terminal there is no player, so user controlled pacmans walk randomly
+    command_t random_cmd = { .command = 'R', .turns = 1 };
+    const command_t *cmd_ptr = &random_cmd;
+
+    if (pacman->program) {
+        cmd_ptr = &pacman->program->ops[pacman->current_move];
+    }
+
+    if (cmd_ptr->command == 'Q') return QUIT_GAME;
+
+    // Quick saves need a live session, skip them
+    if (cmd_ptr->command == 'G') {
+        program_step(pacman->program, &pacman->current_move, &pacman->current_repeat);
+        return CONTINUE_PLAY;
+    }
+
+    // Any pacman reaching the portal clears the level, it is lost once the last one dies
+    int result = move_pacman(board, pacman_index, cmd_ptr);
+    if (result == REACHED_PORTAL) return NEXT_LEVEL;
+    if (result == DEAD_PACMAN && pacmans_alive(board) == 0) return QUIT_GAME;
+    return CONTINUE_PLAY;
+}
+
+// Plays one ghost for the current tick, returns the level outcome it causes
+static int step_ghost(board_t *board, int ghost_index) {
+    ghost_t *ghost = &board->ghosts[ghost_index];
+    if (ghost->program == NULL) return CONTINUE_PLAY;
+
+    const command_t *cmd_ptr = &ghost->program->ops[ghost->current_move];
+    if (move_ghost(board, ghost_index, cmd_ptr) == DEAD_PACMAN && pacmans_alive(board) == 0) return QUIT_GAME;
+    return CONTINUE_PLAY;
+}
+
+// Advances the whole board by one play, pacmans first and then ghosts, always in index order
+int headless_tick(board_t *board) {
+    for (int p = 0; p < board->n_pacmans; p++) {
+        int outcome = step_pacman(board, p);
+        if (outcome != CONTINUE_PLAY) return outcome;
+    }
+
+    for (int g = 0; g < board->n_ghosts; g++) {
+        int outcome = step_ghost(board, g);
+        if (outcome != CONTINUE_PLAY) return outcome;
+    }
+
+    return CONTINUE_PLAY;
+}
+
+// Runs the level until it finishes or the tick budget is spent
+int headless_run_level(board_t *board, long max_ticks, level_result_t *result) {
+    long tick = 0;
+    int outcome = CONTINUE_PLAY;
+
+    while (tick < max_ticks && outcome == CONTINUE_PLAY) {
+        outcome = headless_tick(board);
+        tick++;
+    }
+
+    result->ticks = tick;
+    result->outcome = outcome;
+    result->points = pacmans_points(board);
+    return outcome;
+}
+
+static const char *outcome_name(int outcome) {
+    switch (outcome) {
+        case NEXT_LEVEL: return "portal";
+        case QUIT_GAME: return "game over";
+        default: return "tick limit";
+    }
+}
+
+// Loads a level to be played headlessly, its random moves drawn from 'seed'
+static int load_headless_level(board_t *board, const char *filename, int points, const headless_options_t *options,
+                               unsigned int seed) {
+    if (load_level_cached(board, filename, points) != 0) {
+        log_error("Failed to load level: %s\n", filename);
+        return 1;
+    }
+    strncpy(board->level_name, filename, 255);
+    if (options->lockfree) enable_lockfree_moves(board);
+    seed_random_moves(board, seed);
+    return 0;
+}
+
+// Plays the level list like main() does, but in lockstep and without ncurses
+int run_headless(char lista[][MAX_FILENAME], int n_levels, const headless_options_t *options) {
+    printf("Headless run: %d level(s), up to %ld ticks per level, seed %u%s\n", n_levels, options->max_ticks,
+           options->seed, options->lockfree ? ", lock-free moves" : "");
+
+    int accumulated_points = 0;
+    long total_ticks = 0;
+    double total_seconds = 0;
+
+    for (int i = 0; i < n_levels; i++) {
+        board_t game_board = {0};
+
+        if (load_headless_level(&game_board, lista[i], accumulated_points, options, options->seed + i) != 0) {
+            continue;
+        }
+
+        level_result_t result;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        headless_run_level(&game_board, options->max_ticks, &result);
+        double seconds = elapsed_seconds(&start);
+
+        total_ticks += result.ticks;
+        total_seconds += seconds;
+
+        printf("%-20s %-10s ticks=%-10ld points=%-6d load=%.3fms %.0f ticks/s\n", lista[i],
+               outcome_name(result.outcome), result.ticks, result.points, game_board.load_ms,
+               seconds > 0 ? result.ticks / seconds : 0.0);
+
+        accumulated_points = result.points;
+        unload_level(&game_board);
+
+        if (result.outcome != NEXT_LEVEL) break;
+    }
+
+    printf("Total: %ld ticks in %.3f s (%.0f ticks/s)\n", total_ticks, total_seconds,
+           total_seconds > 0 ? total_ticks / total_seconds : 0.0);
+    return 0;
+}
+
+// How every game of a batch did on one level, each game only writes its own slots
+typedef struct {
+    int width, height;      // dimensions of the level, 0 when it could not be loaded
+    int *outcomes;          // outcome of each game, -1 for games that stopped before this level
+    long *ticks;            // plays each game spent on the level
+    unsigned int *deaths;   // pacmans that died on each cell, added to by every game
+} batch_level_t;
+
+// State shared by the threads of a batch
+typedef struct {
+    char (*lista)[MAX_FILENAME];
+    int n_levels;
+    const headless_options_t *options;
+    batch_level_t *levels;
+    int next_game;          // next game a thread takes, claimed with an atomic increment
+    long total_ticks;       // plays simulated by every game, added to atomically
+} batch_t;
+
+// Plays one game of the batch, level after level until one is not cleared
+static void play_batch_game(batch_t *batch, int game) {
+    unsigned int seed = batch->options->seed + (unsigned int)game * (unsigned int)batch->n_levels;
+    int accumulated_points = 0;
+
+    for (int i = 0; i < batch->n_levels; i++) {
+        batch_level_t *level = &batch->levels[i];
+        if (level->width == 0) continue;
+
+        board_t game_board = {0};
+        if (load_headless_level(&game_board, batch->lista[i], accumulated_points, batch->options, seed + i) != 0) {
+            continue;
+        }
+
+        level_result_t result;
+        headless_run_level(&game_board, batch->options->max_ticks, &result);
+        level->outcomes[game] = result.outcome;
+        level->ticks[game] = result.ticks;
+        __atomic_fetch_add(&batch->total_ticks, result.ticks, __ATOMIC_RELAXED);
+
+        // A pacman keeps the position it died on
+        if (game_board.width == level->width && game_board.height == level->height) {
+            for (int p = 0; p < game_board.n_pacmans; p++) {
+                pacman_t *pacman = &game_board.pacmans[p];
+                if (pacman->alive) continue;
+                __atomic_fetch_add(&level->deaths[pacman->pos_y * level->width + pacman->pos_x], 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        accumulated_points = result.points;
+        unload_level(&game_board);
+
+        if (result.outcome != NEXT_LEVEL) break;
+    }
+}
+
+// Batch Thread: takes the next game that nobody took yet until every game was played
+static void *batch_thread(void *arg) {
+    batch_t *batch = (batch_t *)arg;
+    metrics_name_thread("batch");
+
+    while (1) {
+        int game = __atomic_fetch_add(&batch->next_game, 1, __ATOMIC_RELAXED);
+        if (game >= batch->options->batch) break;
+        play_batch_game(batch, game);
+    }
+    return NULL;
+}
+
+static int compare_ticks(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Value at least a fraction 'q' of the 'n' sorted ticks are not above
+static long ticks_percentile(const long *sorted, int n, double q) {
+    int rank = (int)(q * n + 0.5);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+// Sorts cells by deaths, most first, ties by cell index
+static const unsigned int *sort_deaths;
+static int compare_deaths(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    if (sort_deaths[x] != sort_deaths[y]) return (sort_deaths[x] < sort_deaths[y]) ? 1 : -1;
+    return (x > y) - (x < y);
+}
+
+// Prints how the games of the batch did on one level
+static void report_batch_level(const char *name, const batch_level_t *level, int n_games) {
+    int played = 0, portal = 0, game_over = 0;
+    long *portal_ticks = malloc((size_t)n_games * sizeof(long));
+    if (!portal_ticks) return;
+
+    for (int g = 0; g < n_games; g++) {
+        if (level->outcomes[g] < 0) continue;
+        played++;
+        if (level->outcomes[g] == NEXT_LEVEL) portal_ticks[portal++] = level->ticks[g];
+        else if (level->outcomes[g] == QUIT_GAME) game_over++;
+    }
+
+    printf("%-20s games=%-8d portal=%-8d (%5.1f%%) game over=%-8d tick limit=%d\n", name, played, portal,
+           played > 0 ? 100.0 * portal / played : 0.0, game_over, played - portal - game_over);
+
+    if (portal > 0) {
+        qsort(portal_ticks, portal, sizeof(long), compare_ticks);
+        double sum = 0;
+        for (int g = 0; g < portal; g++) sum += portal_ticks[g];
+        printf("%-20s ticks to portal: min=%ld p50=%ld p90=%ld p99=%ld max=%ld mean=%.1f\n", "", portal_ticks[0],
+               ticks_percentile(portal_ticks, portal, 0.50), ticks_percentile(portal_ticks, portal, 0.90),
+               ticks_percentile(portal_ticks, portal, 0.99), portal_ticks[portal - 1], sum / portal);
+    }
+    free(portal_ticks);
+
+    int n_cells = level->width * level->height;
+    int *cells = malloc((size_t)n_cells * sizeof(int));
+    if (!cells) return;
+    int n_death_cells = 0;
+    unsigned long deaths = 0;
+    for (int c = 0; c < n_cells; c++) {
+        if (level->deaths[c] == 0) continue;
+        cells[n_death_cells++] = c;
+        deaths += level->deaths[c];
+    }
+
+    if (n_death_cells > 0) {
+        sort_deaths = level->deaths;
+        qsort(cells, n_death_cells, sizeof(int), compare_deaths);
+        printf("%-20s deaths=%lu on %d cells, most at", "", deaths, n_death_cells);
+        for (int k = 0; k < n_death_cells && k < BATCH_TOP_DEATHS; k++) {
+            int c = cells[k];
+            printf("%s (%d, %d) x%u", k ? "," : "", c % level->width, c / level->width, level->deaths[c]);
+        }
+        printf("\n");
+    }
+    free(cells);
+}
+
+// Plays many independent games of the level list at once, one thread per core
+int run_batch(char lista[][MAX_FILENAME], int n_levels, const headless_options_t *options) {
+    batch_t batch = { .lista = lista, .n_levels = n_levels, .options = options };
+    batch.levels = calloc(n_levels, sizeof(batch_level_t));
+    if (!batch.levels) return 1;
+
+    // Loading every level once up front gives its dimensions and refreshes its cache before the games share it
+    int failed = 0;
+    for (int i = 0; i < n_levels && !failed; i++) {
+        board_t game_board = {0};
+        if (load_level_cached(&game_board, lista[i], 0) != 0) {
+            log_error("Failed to load level: %s\n", lista[i]);
+            continue;
+        }
+        batch_level_t *level = &batch.levels[i];
+        level->outcomes = malloc((size_t)options->batch * sizeof(int));
+        level->ticks = calloc(options->batch, sizeof(long));
+        level->deaths = calloc((size_t)game_board.width * game_board.height, sizeof(unsigned int));
+        if (level->outcomes && level->ticks && level->deaths) {
+            memset(level->outcomes, -1, (size_t)options->batch * sizeof(int));
+            level->width = game_board.width;
+            level->height = game_board.height;
+        } else {
+            failed = 1;
+        }
+        unload_level(&game_board);
+    }
+
+    long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_threads = (n_cores > 0) ? (int)n_cores : 1;
+    if (n_threads > options->batch) n_threads = options->batch;
+
+    printf("Batch run: %d game(s) of %d level(s) on %d thread(s), up to %ld ticks per level, seeds from %u%s\n",
+           options->batch, n_levels, n_threads, options->max_ticks, options->seed,
+           options->lockfree ? ", lock-free moves" : "");
+
+    pthread_t *tids = failed ? NULL : malloc(n_threads * sizeof(pthread_t));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int started = 0;
+    for (; tids && started < n_threads; started++) {
+        if (pthread_create(&tids[started], NULL, batch_thread, &batch) != 0) break;
+    }
+    // With no thread at all the games are played right here
+    if (tids && started == 0) batch_thread(&batch);
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    double seconds = elapsed_seconds(&start);
+
+    if (tids) {
+        for (int i = 0; i < n_levels; i++) {
+            if (batch.levels[i].width > 0) report_batch_level(lista[i], &batch.levels[i], options->batch);
+        }
+        printf("Total: %d game(s), %ld ticks in %.3f s (%.0f ticks/s, %.0f games/s)\n", options->batch,
+               batch.total_ticks, seconds, seconds > 0 ? batch.total_ticks / seconds : 0.0,
+               seconds > 0 ? options->batch / seconds : 0.0);
+    } else {
+        fprintf(stderr, "Error: not enough memory for a batch of %d games\n", options->batch);
+    }
+
+    int ok = tids != NULL;
+    free(tids);
+    for (int i = 0; i < n_levels; i++) {
+        free(batch.levels[i].outcomes);
+        free(batch.levels[i].ticks);
+        free(batch.levels[i].deaths);
+    }
+    free(batch.levels);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include "history.h"
+#include "checkpoint.h"
+#include <stdlib.h>
+#include <string.h>
+
+void history_init(history_t* history, unsigned long capacity) {
+    unsigned long size = 1;
+    while (size < capacity) size <<= 1;
+
+    memset(history, 0, sizeof(*history));
+    history->records = malloc(size * sizeof(history_record_t));
+    history->mask = size - 1;
+}
+
+void history_tick(history_t* history) {
+    __atomic_fetch_add(&history->tick, 1, __ATOMIC_RELAXED);
+}
+
+// Reserves the next slot of the ring, overwriting the oldest record once it is full
+static history_record_t* append(history_t* history, int kind, int index) {
+    unsigned long seq = __atomic_fetch_add(&history->head, 1, __ATOMIC_RELAXED);
+    history_record_t* record = &history->records[seq & history->mask];
+    record->tick = __atomic_load_n(&history->tick, __ATOMIC_RELAXED);
+    record->kind = kind;
+    record->index = index;
+    return record;
+}
+
+void history_record_cell(history_t* history, const board_t* board, int index) {
+    history_record_t* record = append(history, HISTORY_CELL, index);
+    record->old.cell = board->board[index];
+}
+
+void history_record_entity(history_t* history, const board_t* board, int kind, int index) {
+    history_record_t* record = append(history, kind, index);
+    history_entity_t* old = &record->old.entity;
+
+    if (kind == HISTORY_PACMAN) {
+        const pacman_t* pac = &board->pacmans[index];
+        *old = (history_entity_t){ pac->pos_x, pac->pos_y, pac->alive, pac->points,
+                                   pac->current_move, pac->current_repeat, pac->waiting, 0, pac->rng };
+    } else {
+        const ghost_t* ghost = &board->ghosts[index];
+        *old = (history_entity_t){ ghost->pos_x, ghost->pos_y, 1, 0,
+                                   ghost->current_move, ghost->current_repeat, ghost->waiting, ghost->charged,
+                                   ghost->rng };
+    }
+}
+
+// Puts back what one record says a cell or entity held before its change
+static void undo(board_t* board, const history_record_t* record) {
+    const history_entity_t* old = &record->old.entity;
+
+    switch (record->kind) {
+        case HISTORY_CELL:
+            if (board->checkpoint) checkpoint_save_page(board->checkpoint, board, record->index);
+            board->board[record->index] = record->old.cell;
+            resync_cells(board, record->index, 1);
+            break;
+
+        case HISTORY_PACMAN: {
+            pacman_t* pac = &board->pacmans[record->index];
+            pac->pos_x = old->pos_x;
+            pac->pos_y = old->pos_y;
+            pac->alive = old->alive;
+            pac->points = old->points;
+            pac->current_move = old->current_move;
+            pac->current_repeat = old->current_repeat;
+            pac->waiting = old->waiting;
+            pac->rng = old->rng;
+            break;
+        }
+
+        case HISTORY_GHOST: {
+            ghost_t* ghost = &board->ghosts[record->index];
+            ghost->pos_x = old->pos_x;
+            ghost->pos_y = old->pos_y;
+            ghost->current_move = old->current_move;
+            ghost->current_repeat = old->current_repeat;
+            ghost->waiting = old->waiting;
+            ghost->charged = old->charged;
+            ghost->rng = old->rng;
+            break;
+        }
+    }
+}
+
+// Walks the ring backwards from the newest record, undoing every one made during or after the target tick
+unsigned long history_rewind(history_t* history, board_t* board, unsigned long ticks) {
+    unsigned long capacity = history->mask + 1;
+    unsigned long oldest = (history->head > capacity) ? history->head - capacity : 0;
+    unsigned long target = (ticks < history->tick) ? history->tick - ticks : 0;
+
+    // The oldest tick still in the ring may have lost its first records to the wrap, so it is not undone
+    if (oldest > 0 && target <= history->records[oldest & history->mask].tick) {
+        target = history->records[oldest & history->mask].tick + 1;
+    }
+    if (target > history->tick) target = history->tick;
+
+    // Undoing is not a move, the board must not record it
+    struct history* recording = board->history;
+    board->history = NULL;
+
+    // A slot is reserved before its record is stamped, so a mover the render thread overtook in between
+    // leaves a record of the previous tick among the newer ones; the walk only stops past that tick
+    unsigned long seq = history->head;
+    while (seq > oldest) {
+        const history_record_t* record = &history->records[(seq - 1) & history->mask];
+        if (record->tick + 1 < target) break;
+        if (record->tick >= target) undo(board, record);
+        seq--;
+    }
+    place_entities(board);
+
+    board->history = recording;
+
+    // The records of the previous tick that were passed over stay in the ring, in the order they were made
+    unsigned long kept = seq;
+    for (unsigned long s = seq; s < history->head; s++) {
+        const history_record_t* record = &history->records[s & history->mask];
+        if (record->tick < target) history->records[kept++ & history->mask] = *record;
+    }
+
+    unsigned long undone = history->tick - target;
+    history->head = kept;
+    history->tick = target;
+    return undone;
+}
+
+void history_clear(history_t* history) {
+    history->head = 0;
+    history->tick = 0;
+}
+
+void history_free(history_t* history) {
+    free(history->records);
+    memset(history, 0, sizeof(*history));
+}
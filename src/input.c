@@ -0,0 +1,146 @@
+#include "input.h"
+#include "metrics.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ESC 27
+
+// Where the decoder is inside an escape sequence such as the ESC O A an arrow key sends
+#define ESCAPE_NONE 0
+#define ESCAPE_START 1 // after ESC
+#define ESCAPE_BODY 2  // after ESC [ or ESC O, until the final byte
+
+int input_init(input_queue_t* queue) {
+    memset(queue, 0, sizeof(*queue));
+    if (pipe(queue->wake) != 0) return 1;
+    fcntl(queue->wake[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+// Producer side: publishes the key only after its slot is written
+static void push_key(input_queue_t* queue, char key, const struct timespec* at) {
+    unsigned int tail = queue->tail;
+    unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head == INPUT_RING_SIZE) {
+        queue->dropped++;
+        return;
+    }
+
+    keypress_t* slot = &queue->ring[tail & (INPUT_RING_SIZE - 1)];
+    slot->key = key;
+    slot->at = *at;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Turns one byte from the terminal into a game key, '\0' for anything else
+// Escape sequences are skipped whole, otherwise the arrow keys would read as A, B, C and D
+static char decode_byte(input_queue_t* queue, unsigned char byte) {
+    switch (queue->escape) {
+        case ESCAPE_START:
+            if (byte == '[' || byte == 'O') {
+                queue->escape = ESCAPE_BODY;
+                return '\0';
+            }
+            // A lone ESC, or Alt with a key, the byte after it is a key of its own
+            queue->escape = ESCAPE_NONE;
+            break;
+        case ESCAPE_BODY:
+            if (byte >= 0x40 && byte <= 0x7E) queue->escape = ESCAPE_NONE;
+            return '\0';
+    }
+
+    if (byte == ESC) {
+        queue->escape = ESCAPE_START;
+        return '\0';
+    }
+
+    char key = (char)toupper(byte);
+    switch (key) {
+        case 'W':
+        case 'S':
+        case 'A':
+        case 'D':
+        case 'Q':
+        case 'G':
+        case 'U':
+            return key;
+        default:
+            return '\0';
+    }
+}
+
+int input_read_keys(input_queue_t* queue, int fd, int timeout_ms) {
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = queue->wake[0], .events = POLLIN },
+    };
+
+    while (1) {
+        int ready = poll(fds, 2, timeout_ms);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (ready == 0) return 0;
+        if (fds[1].revents) return -1;
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) return -1;
+        if (fds[0].revents & POLLIN) break;
+    }
+
+    unsigned char bytes[64];
+    ssize_t n = read(fd, bytes, sizeof(bytes));
+    if (n <= 0) return (n < 0 && errno == EINTR) ? 0 : -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int queued = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        char key = decode_byte(queue, bytes[i]);
+        if (key == '\0') continue;
+        push_key(queue, key, &now);
+        queued++;
+    }
+
+    // Terminals send a whole escape sequence in one write, an ESC ending the read was pressed on its own
+    if (queue->escape == ESCAPE_START) queue->escape = ESCAPE_NONE;
+    return queued;
+}
+
+int input_pop(input_queue_t* queue, keypress_t* key) {
+    unsigned int head = queue->head;
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) return 0;
+
+    *key = queue->ring[head & (INPUT_RING_SIZE - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void input_played(input_queue_t* queue, const keypress_t* key) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ns = (int64_t)(now.tv_sec - key->at.tv_sec) * 1000000000 + (now.tv_nsec - key->at.tv_nsec);
+    double ms = ns / 1e6;
+    metrics_record(HIST_INPUT_LATENCY, ns > 0 ? (uint64_t)ns : 0);
+
+    queue->n_moves++;
+    queue->total_ms += ms;
+    if (ms > queue->max_ms) queue->max_ms = ms;
+}
+
+void input_stop(input_queue_t* queue) {
+    char byte = 1;
+    if (write(queue->wake[1], &byte, 1) < 0) {
+        // The pipe already holds a wake-up byte
+    }
+}
+
+void input_destroy(input_queue_t* queue) {
+    close(queue->wake[0]);
+    close(queue->wake[1]);
+}
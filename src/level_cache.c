@@ -0,0 +1,374 @@
+#include "level_cache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "PACLVL1"
+#define CACHE_VERSION 2
+#define CACHE_CELLS_ALIGN 65536 // cells start on a boundary every page size divides, so they can be mapped as they are
+
+// Fixed header at the start of a cache file, every offset is from the start of the file
+// The file is written in the host's byte order and is not meant to be moved between machines
+typedef struct {
+    char magic[8];          // CACHE_MAGIC
+    uint32_t version;       // CACHE_VERSION
+    uint32_t cell_size;     // sizeof(board_pos_t) when the cache was written
+    int64_t src_mtime_sec;  // modification time of the level file
+    int64_t src_mtime_nsec;
+    int64_t src_size;       // size of the level file
+    int32_t width, height;  // dimensions of the board
+    int32_t tempo;          // duration of each play
+    int32_t n_pacmans;      // number of pacmans, the first n_pacman_files were read from files
+    int32_t n_ghosts;       // number of ghosts, each one read from a file
+    int32_t n_pacman_files; // 0 when the level has no PAC line
+    int32_t n_programs;     // distinct compiled entity files
+    int32_t n_ops;          // instructions of every program together
+    uint64_t deps_offset;     // n_pacman_files + n_ghosts cache_dep_t
+    uint64_t entities_offset; // n_pacmans + n_ghosts cache_entity_t
+    uint64_t programs_offset; // n_programs cache_program_t
+    uint64_t ops_offset;      // n_ops cache_op_t
+    uint64_t cells_offset;    // width * height board_pos_t, aligned to CACHE_CELLS_ALIGN
+    uint64_t file_size;       // total size of the cache
+} cache_header_t;
+
+// An entity file the level depends on, the cache is stale as soon as one of them changes
+typedef struct {
+    char name[MAX_FILENAME];
+    int64_t mtime_sec, mtime_nsec;
+    int64_t size; // -1 when the file did not exist
+} cache_dep_t;
+
+// Initial state of a pacman or ghost
+typedef struct {
+    int32_t pos_x, pos_y;
+    int32_t passo;
+    int32_t waiting;
+    int32_t program; // index of its program, -1 when it has none
+} cache_entity_t;
+
+// A compiled entity file
+typedef struct {
+    char file[MAX_FILENAME];
+    int32_t passo;
+    int32_t pos_x, pos_y;
+    int32_t has_pos;
+    int32_t n_ops;
+    int32_t first_op; // index of its first instruction in the ops array
+} cache_program_t;
+
+typedef struct {
+    char command;
+    char pad[3];
+    int32_t turns;
+} cache_op_t;
+
+// Index of the board program an entity runs, -1 when it has none
+static int32_t program_index(board_t *board, const program_t *program) {
+    if (!program) return -1;
+    for (int i = 0; i < board->n_programs; i++) {
+        if (board->programs[i] == program) return i;
+    }
+    return -1;
+}
+
+// Fills a dependency record with the current mtime and size of a file
+static void stamp_file(const char *name, cache_dep_t *dep) {
+    struct stat st;
+    memset(dep, 0, sizeof(*dep));
+    snprintf(dep->name, sizeof(dep->name), "%s", name);
+
+    if (stat(name, &st) != 0) {
+        dep->size = -1;
+        return;
+    }
+    dep->mtime_sec = st.st_mtim.tv_sec;
+    dep->mtime_nsec = st.st_mtim.tv_nsec;
+    dep->size = st.st_size;
+}
+
+static uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Writes the cache to a temporary file and renames it over the old one, so readers never see half a cache
+int write_level_cache(board_t *board, const char *filename) {
+    struct stat src;
+    if (stat(filename, &src) != 0) return 1;
+
+    int n_pacman_files = board->pacmans_files ? board->n_pacmans : 0;
+    int n_deps = n_pacman_files + board->n_ghosts;
+    int n_entities = board->n_pacmans + board->n_ghosts;
+    int n_ops = 0;
+    for (int i = 0; i < board->n_programs; i++) n_ops += board->programs[i]->n_ops;
+
+    cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.cell_size = sizeof(board_pos_t);
+    header.src_mtime_sec = src.st_mtim.tv_sec;
+    header.src_mtime_nsec = src.st_mtim.tv_nsec;
+    header.src_size = src.st_size;
+    header.width = board->width;
+    header.height = board->height;
+    header.tempo = board->tempo;
+    header.n_pacmans = board->n_pacmans;
+    header.n_ghosts = board->n_ghosts;
+    header.n_pacman_files = n_pacman_files;
+    header.n_programs = board->n_programs;
+    header.n_ops = n_ops;
+    header.deps_offset = sizeof(cache_header_t);
+    header.entities_offset = header.deps_offset + (uint64_t)n_deps * sizeof(cache_dep_t);
+    header.programs_offset = header.entities_offset + (uint64_t)n_entities * sizeof(cache_entity_t);
+    header.ops_offset = header.programs_offset + (uint64_t)board->n_programs * sizeof(cache_program_t);
+    header.cells_offset = align_up(header.ops_offset + (uint64_t)n_ops * sizeof(cache_op_t), CACHE_CELLS_ALIGN);
+    header.file_size = header.cells_offset + (uint64_t)board->width * board->height * sizeof(board_pos_t);
+
+    char cache_path[MAX_FILENAME + 16];
+    char tmp_path[MAX_FILENAME + 32];
+    snprintf(cache_path, sizeof(cache_path), "%s%s", filename, LEVEL_CACHE_SUFFIX);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", cache_path);
+
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) return 1;
+    fchmod(fd, 0644);
+    FILE *out = fdopen(fd, "wb");
+    if (!out) { close(fd); unlink(tmp_path); return 1; }
+
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    for (int d = 0; d < n_deps && ok; d++) {
+        cache_dep_t dep;
+        const char *name = (d < n_pacman_files) ? board->pacmans_files[d] : board->ghosts_files[d - n_pacman_files];
+        stamp_file(name, &dep);
+        ok = fwrite(&dep, sizeof(dep), 1, out) == 1;
+    }
+
+    for (int e = 0; e < n_entities && ok; e++) {
+        cache_entity_t entity;
+        if (e < board->n_pacmans) {
+            pacman_t *pac = &board->pacmans[e];
+            entity = (cache_entity_t){ pac->pos_x, pac->pos_y, pac->passo, pac->waiting,
+                                       program_index(board, pac->program) };
+        } else {
+            ghost_t *ghost = &board->ghosts[e - board->n_pacmans];
+            entity = (cache_entity_t){ ghost->pos_x, ghost->pos_y, ghost->passo, ghost->waiting,
+                                       program_index(board, ghost->program) };
+        }
+        ok = fwrite(&entity, sizeof(entity), 1, out) == 1;
+    }
+
+    int first_op = 0;
+    for (int i = 0; i < board->n_programs && ok; i++) {
+        const program_t *program = board->programs[i];
+        cache_program_t record;
+        memset(&record, 0, sizeof(record));
+        snprintf(record.file, sizeof(record.file), "%s", program->file);
+        record.passo = program->passo;
+        record.pos_x = program->pos_x;
+        record.pos_y = program->pos_y;
+        record.has_pos = program->has_pos;
+        record.n_ops = program->n_ops;
+        record.first_op = first_op;
+        first_op += program->n_ops;
+        ok = fwrite(&record, sizeof(record), 1, out) == 1;
+    }
+
+    for (int i = 0; i < board->n_programs && ok; i++) {
+        const program_t *program = board->programs[i];
+        for (int o = 0; o < program->n_ops && ok; o++) {
+            cache_op_t op;
+            memset(&op, 0, sizeof(op));
+            op.command = program->ops[o].command;
+            op.turns = program->ops[o].turns;
+            ok = fwrite(&op, sizeof(op), 1, out) == 1;
+        }
+    }
+
+    if (ok) ok = fseek(out, (long)header.cells_offset, SEEK_SET) == 0;
+    if (ok) ok = fwrite(board->board, sizeof(board_pos_t), (size_t)board->width * board->height, out)
+                 == (size_t)board->width * board->height;
+
+    if (fclose(out) != 0) ok = 0;
+    if (ok) ok = rename(tmp_path, cache_path) == 0;
+    if (!ok) {
+        unlink(tmp_path);
+        log_warn("Could not write level cache %s\n", cache_path);
+        return 1;
+    }
+
+    log_info("Wrote level cache %s (%llu bytes)\n", cache_path, (unsigned long long)header.file_size);
+    return 0;
+}
+
+// Checks that a mapped cache is complete and still matches its level and entity files
+static int cache_is_fresh(const char *data, size_t size, const struct stat *src) {
+    if (size < sizeof(cache_header_t)) return 0;
+    const cache_header_t *header = (const cache_header_t *)data;
+
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0) return 0;
+    if (header->version != CACHE_VERSION || header->cell_size != sizeof(board_pos_t)) return 0;
+    if (header->file_size != size) return 0;
+    if (header->src_mtime_sec != src->st_mtim.tv_sec || header->src_mtime_nsec != src->st_mtim.tv_nsec ||
+        header->src_size != src->st_size) return 0;
+    if (header->width <= 0 || header->height <= 0 || header->n_pacmans <= 0 || header->n_ghosts < 0) return 0;
+    if (header->n_pacman_files != 0 && header->n_pacman_files != header->n_pacmans) return 0;
+
+    int n_deps = header->n_pacman_files + header->n_ghosts;
+    int n_entities = header->n_pacmans + header->n_ghosts;
+    if (header->entities_offset != header->deps_offset + (uint64_t)n_deps * sizeof(cache_dep_t)) return 0;
+    if (header->n_programs < 0 || header->n_ops < 0) return 0;
+    if (header->programs_offset != header->entities_offset + (uint64_t)n_entities * sizeof(cache_entity_t)) return 0;
+    if (header->ops_offset != header->programs_offset + (uint64_t)header->n_programs * sizeof(cache_program_t)) return 0;
+    if (header->cells_offset % CACHE_CELLS_ALIGN != 0 ||
+        header->cells_offset < header->ops_offset + (uint64_t)header->n_ops * sizeof(cache_op_t)) return 0;
+    if (header->cells_offset + (uint64_t)header->width * header->height * sizeof(board_pos_t) != size) return 0;
+
+    const cache_dep_t *deps = (const cache_dep_t *)(data + header->deps_offset);
+    for (int d = 0; d < n_deps; d++) {
+        cache_dep_t now;
+        stamp_file(deps[d].name, &now);
+        if (now.size != deps[d].size || now.mtime_sec != deps[d].mtime_sec || now.mtime_nsec != deps[d].mtime_nsec)
+            return 0;
+    }
+
+    const cache_entity_t *entities = (const cache_entity_t *)(data + header->entities_offset);
+    for (int e = 0; e < n_entities; e++) {
+        if (entities[e].program < -1 || entities[e].program >= header->n_programs) return 0;
+    }
+
+    const cache_program_t *programs = (const cache_program_t *)(data + header->programs_offset);
+    for (int i = 0; i < header->n_programs; i++) {
+        if (programs[i].n_ops < 0 || programs[i].first_op < 0 ||
+            programs[i].first_op + programs[i].n_ops > header->n_ops) return 0;
+        if (memchr(programs[i].file, '\0', sizeof(programs[i].file)) == NULL) return 0;
+    }
+    return 1;
+}
+
+// Copies the programs out of the cache into the board, in the same order so entity indices still match
+static void copy_programs(board_t *board, const cache_program_t *programs, int n_programs, const cache_op_t *ops) {
+    for (int i = 0; i < n_programs; i++) {
+        const cache_program_t *record = &programs[i];
+        program_t *program = add_program(board, record->file, record->n_ops);
+        program->passo = record->passo;
+        program->pos_x = record->pos_x;
+        program->pos_y = record->pos_y;
+        program->has_pos = record->has_pos;
+        for (int o = 0; o < record->n_ops; o++) {
+            program->ops[o].command = ops[record->first_op + o].command;
+            program->ops[o].turns = ops[record->first_op + o].turns;
+        }
+    }
+}
+
+// Program an entity of the cache runs, NULL when it has none or it has no moves
+static const program_t *entity_program(board_t *board, const cache_entity_t *entity) {
+    if (entity->program < 0) return NULL;
+    const program_t *program = board->programs[entity->program];
+    return (program->n_ops > 0) ? program : NULL;
+}
+
+// Fills the board from a fresh cache, the cells are mapped copy-on-write straight from the file
+static int load_from_cache(board_t *board, const char *filename, int points) {
+    struct stat src, st;
+    if (stat(filename, &src) != 0) return 1;
+
+    char cache_path[MAX_FILENAME + 16];
+    snprintf(cache_path, sizeof(cache_path), "%s%s", filename, LEVEL_CACHE_SUFFIX);
+
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) return 1;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(cache_header_t)) { close(fd); return 1; }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) { close(fd); return 1; }
+
+    if (!cache_is_fresh(data, st.st_size, &src)) {
+        munmap(data, st.st_size);
+        close(fd);
+        return 1;
+    }
+
+    const cache_header_t *header = (const cache_header_t *)data;
+    size_t cells_bytes = (size_t)header->width * header->height * sizeof(board_pos_t);
+    void *cells = mmap(NULL, cells_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, header->cells_offset);
+    close(fd);
+    if (cells == MAP_FAILED) {
+        munmap(data, st.st_size);
+        return 1;
+    }
+
+    const cache_dep_t *deps = (const cache_dep_t *)(data + header->deps_offset);
+    const cache_entity_t *entities = (const cache_entity_t *)(data + header->entities_offset);
+    const cache_program_t *programs = (const cache_program_t *)(data + header->programs_offset);
+    const cache_op_t *ops = (const cache_op_t *)(data + header->ops_offset);
+
+    board->width = header->width;
+    board->height = header->height;
+    board->tempo = header->tempo;
+    board->board = cells;
+    board->cells_mapped = cells_bytes;
+
+    copy_programs(board, programs, header->n_programs, ops);
+
+    board->n_pacmans = header->n_pacmans;
+    board->pacmans = calloc(board->n_pacmans, sizeof(pacman_t));
+    if (header->n_pacman_files > 0) {
+        board->pacmans_files = calloc(board->n_pacmans, sizeof(char *));
+        snprintf(board->pacman_file, sizeof(board->pacman_file), "%s", deps[0].name);
+    }
+    for (int p = 0; p < board->n_pacmans; p++) {
+        const cache_entity_t *entity = &entities[p];
+        pacman_t *pac = &board->pacmans[p];
+        pac->pos_x = entity->pos_x;
+        pac->pos_y = entity->pos_y;
+        pac->alive = 1;
+        pac->points = (p == 0) ? points : 0;
+        pac->passo = entity->passo;
+        pac->waiting = entity->waiting;
+        pac->program = entity_program(board, entity);
+        if (board->pacmans_files) board->pacmans_files[p] = strdup(deps[p].name);
+    }
+
+    board->n_ghosts = header->n_ghosts;
+    board->ghosts = calloc(board->n_ghosts, sizeof(ghost_t));
+    board->ghosts_files = calloc(board->n_ghosts, sizeof(char *));
+    for (int g = 0; g < board->n_ghosts; g++) {
+        const cache_entity_t *entity = &entities[board->n_pacmans + g];
+        ghost_t *ghost = &board->ghosts[g];
+        ghost->pos_x = entity->pos_x;
+        ghost->pos_y = entity->pos_y;
+        ghost->passo = entity->passo;
+        ghost->waiting = entity->waiting;
+        ghost->program = entity_program(board, entity);
+        board->ghosts_files[g] = strdup(deps[header->n_pacman_files + g].name);
+    }
+
+    munmap(data, st.st_size);
+    prepare_board(board);
+    return 0;
+}
+
+// Loads from the cache when it is fresh, otherwise parses the text level and refreshes the cache
+int load_level_cached(board_t *board, const char *filename, int points) {
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (load_from_cache(board, filename, points) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        board->load_ms = (finish.tv_sec - start.tv_sec) * 1e3 + (finish.tv_nsec - start.tv_nsec) / 1e6;
+        log_info("Loaded %s from its cache (%dx%d, %d ghosts) in %.3f ms\n", filename,
+              board->width, board->height, board->n_ghosts, board->load_ms);
+        return 0;
+    }
+
+    if (load_level_filename(board, filename, points) != 0) return 1;
+    write_level_cache(board, filename);
+    return 0;
+}
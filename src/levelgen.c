@@ -0,0 +1,358 @@
+#include "board.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define PACMAN_NONE 0   // pacmans without moves, left to the player (the others walk randomly)
+#define PACMAN_RANDOM 1 // random scripts, like the ghosts' without charges
+#define PACMAN_PATH 2   // the first pacman walks the shortest way to the portal, the others play random scripts
+
+// Where the pacman always starts, find_first_free_pos picks the same cell for a pacman without a POS line
+#define START_X 1
+#define START_Y 1
+
+// Odds, out of 100, of the commands of a script that are not charges
+#define WAIT_ODDS 10
+#define RANDOM_ODDS 15
+#define MAX_WAIT 5
+
+// Everything a set of levels is generated from, the same options always give the same files
+typedef struct {
+    unsigned long seed;   // seed of every random draw
+    int width, height;    // dimensions of each level, border walls included
+    double walls;         // fraction of the inner cells turned into walls before the way to the portal is carved
+    int n_ghosts;         // ghosts of each level, fewer when the level has no room for them
+    int n_pacmans;        // pacmans of each level, likewise
+    int script_length;    // commands in each script
+    double charge;        // fraction of the ghost commands that are charges
+    int passo;            // PASSO of every script
+    int tempo;            // TEMPO of each level
+    int n_levels;         // levels written, 1.lvl to n.lvl
+    int pacman;           // PACMAN_NONE, PACMAN_RANDOM or PACMAN_PATH, how the pacmans are played
+} gen_options_t;
+
+// Cells of a level as they are written: 'X' wall, 'o' dot and '@' portal
+typedef struct {
+    int width, height;
+    char *cells;          // row-major
+    unsigned char *from;  // direction the search reached each cell from, 0 for cells it did not reach
+    int *reached;         // cells reachable from the start, in the order the search reached them
+    int n_reached;
+    int portal;           // index of the portal cell
+} level_t;
+
+static uint64_t rng_state;
+
+// splitmix64, every draw of a level comes from one sequence seeded by the level number and the seed
+static uint64_t next_random(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Uniform draw in [0, n)
+static int random_below(int n) {
+    return (int)(next_random() % (uint64_t)n);
+}
+
+// Uniform draw in [0, 1)
+static double random_unit(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const char directions[] = "WASD";
+static const int step_x[] = { 0, -1, 0, 1 };
+static const int step_y[] = { -1, 0, 1, 0 };
+
+// Scatters walls over the inner cells and leaves the border closed
+static void scatter_walls(level_t *level, double walls) {
+    for (int y = 0; y < level->height; y++) {
+        for (int x = 0; x < level->width; x++) {
+            int border = x == 0 || y == 0 || x == level->width - 1 || y == level->height - 1;
+            level->cells[y * level->width + x] = (border || random_unit() < walls) ? 'X' : 'o';
+        }
+    }
+}
+
+// Picks the portal in the quarter of the level opposite to the start and clears a wandering way to it
+// The walk leans towards the portal, so it always gets there, but turns often enough to look like a corridor
+static void carve_to_portal(level_t *level) {
+    int inner_w = level->width - 2, inner_h = level->height - 2;
+    int px = 1 + inner_w / 2 + random_below(inner_w - inner_w / 2);
+    int py = 1 + inner_h / 2 + random_below(inner_h - inner_h / 2);
+    if (px == START_X && py == START_Y) px = level->width - 2;
+
+    int x = START_X, y = START_Y;
+    level->cells[y * level->width + x] = 'o';
+    while (x != px || y != py) {
+        int d;
+        if (random_below(4) != 0) {
+            // Towards the portal, along whichever axis is chosen first
+            int horizontal = (x != px) && (y == py || random_below(2));
+            d = horizontal ? (px < x ? 1 : 3) : (py < y ? 0 : 2);
+        } else {
+            d = random_below(4);
+        }
+        int nx = x + step_x[d], ny = y + step_y[d];
+        if (nx < 1 || ny < 1 || nx > level->width - 2 || ny > level->height - 2) continue;
+        x = nx;
+        y = ny;
+        level->cells[y * level->width + x] = 'o';
+    }
+
+    level->portal = py * level->width + px;
+    level->cells[level->portal] = '@';
+}
+
+// Breadth-first search from the start, remembering how each cell was reached
+static int search_from_start(level_t *level) {
+    int n_cells = level->width * level->height;
+    level->from = calloc(n_cells, 1);
+    level->reached = malloc(n_cells * sizeof(int));
+    if (!level->from || !level->reached) return 1;
+
+    int start = START_Y * level->width + START_X;
+    level->from[start] = 0xFF;
+    level->reached[0] = start;
+    level->n_reached = 1;
+
+    for (int head = 0; head < level->n_reached; head++) {
+        int cell = level->reached[head];
+        int x = cell % level->width, y = cell / level->width;
+        for (int d = 0; d < 4; d++) {
+            int next = (y + step_y[d]) * level->width + (x + step_x[d]);
+            if (level->cells[next] == 'X' || level->from[next]) continue;
+            level->from[next] = (unsigned char)(d + 1);
+            level->reached[level->n_reached++] = next;
+        }
+    }
+    return level->from[level->portal] ? 0 : 1;
+}
+
+// Writes the moves of a script, 'charge' of them being a charge followed by the direction it goes in
+static void write_moves(FILE *out, int length, double charge) {
+    int lines = 0;
+    while (lines < length) {
+        int odds = random_below(100);
+        if (charge > 0 && random_unit() < charge && lines + 1 < length) {
+            fprintf(out, "C\n%c\n", directions[random_below(4)]);
+            lines += 2;
+            continue;
+        }
+        if (odds < WAIT_ODDS) fprintf(out, "T%d\n", 1 + random_below(MAX_WAIT));
+        else if (odds < WAIT_ODDS + RANDOM_ODDS) fputs("R\n", out);
+        else fprintf(out, "%c\n", directions[random_below(4)]);
+        lines++;
+    }
+}
+
+// Writes the shortest way from the start to the portal, one step per line
+static void write_path(FILE *out, const level_t *level) {
+    int length = 0;
+    for (int cell = level->portal; level->from[cell] != 0xFF; length++) {
+        int d = level->from[cell] - 1;
+        cell -= step_y[d] * level->width + step_x[d];
+    }
+
+    char *steps = malloc(length + 1);
+    if (!steps) return;
+    int i = length;
+    for (int cell = level->portal; level->from[cell] != 0xFF;) {
+        int d = level->from[cell] - 1;
+        steps[--i] = directions[d];
+        cell -= step_y[d] * level->width + step_x[d];
+    }
+    for (i = 0; i < length; i++) fprintf(out, "%c\n", steps[i]);
+    free(steps);
+}
+
+// Writes the script of an entity standing at (x, y)
+// Only the first pacman walks the way to the portal, the others play random scripts and
+// with PACMAN_NONE the pacmans get no moves at all, leaving them to the player
+static int write_script(const char *filename, const gen_options_t *options, int x, int y, const level_t *level,
+                        int is_pacman, int first) {
+    FILE *out = fopen(filename, "w");
+    if (!out) return 1;
+    fprintf(out, "PASSO %d\nPOS %d %d\n", options->passo, y, x);
+    if (!is_pacman) write_moves(out, options->script_length, options->charge);
+    else if (options->pacman == PACMAN_PATH && first) write_path(out, level);
+    else if (options->pacman != PACMAN_NONE) write_moves(out, options->script_length, 0.0);
+    return fclose(out) != 0;
+}
+
+// Draws a reachable cell no entity took yet, never the start or the portal; -1 once none is left
+// The reachable cells after the first 'drawn' ones are still to be drawn
+static int draw_free_cell(level_t *level, int *drawn) {
+    while (*drawn < level->n_reached) {
+        int i = (*drawn)++;
+        int pick = i + random_below(level->n_reached - i);
+        int cell = level->reached[pick];
+        level->reached[pick] = level->reached[i];
+        level->reached[i] = cell;
+        if (cell != level->portal) return cell;
+    }
+    return -1;
+}
+
+// Name of the script of pacman 'p', the first one keeps the plain level number
+static void pacman_file(char *filename, int number, int p) {
+    if (p == 0) snprintf(filename, MAX_FILENAME, "%d.p", number);
+    else snprintf(filename, MAX_FILENAME, "%d-p%d.p", number, p);
+}
+
+// Generates level 'number' and writes it with its scripts into the current directory, returns 0 on success
+static int generate_level(int number, const gen_options_t *options) {
+    rng_state = options->seed * 0x100000001B3ull + (uint64_t)number;
+
+    level_t level = { .width = options->width, .height = options->height };
+    level.cells = malloc((size_t)level.width * level.height);
+    if (!level.cells) return 1;
+
+    scatter_walls(&level, options->walls);
+    carve_to_portal(&level);
+    int failed = search_from_start(&level);
+
+    // The first pacman stands on the start, the other pacmans and the ghosts take distinct reachable cells
+    // other than the start and the portal, drawn without replacement
+    int room = level.n_reached - 2;
+    int n_pacmans = options->n_pacmans;
+    if (n_pacmans > room + 1) n_pacmans = room + 1;
+    if (n_pacmans > OCC_MAX_ENTITIES) n_pacmans = OCC_MAX_ENTITIES;
+    int n_ghosts = options->n_ghosts;
+    if (n_ghosts > room - (n_pacmans - 1)) n_ghosts = room - (n_pacmans - 1);
+    if (n_ghosts > OCC_MAX_ENTITIES) n_ghosts = OCC_MAX_ENTITIES;
+    if ((n_pacmans < options->n_pacmans || n_ghosts < options->n_ghosts) && !failed) {
+        fprintf(stderr, "Warning: level %d only has room for %d pacmans and %d ghosts\n", number, n_pacmans, n_ghosts);
+    }
+
+    char filename[MAX_FILENAME];
+    int drawn = 1;
+    for (int p = 0; p < n_pacmans && !failed; p++) {
+        int cell = (p == 0) ? START_Y * level.width + START_X : draw_free_cell(&level, &drawn);
+        pacman_file(filename, number, p);
+        failed = write_script(filename, options, cell % level.width, cell / level.width, &level, 1, p == 0);
+    }
+    for (int g = 0; g < n_ghosts && !failed; g++) {
+        int cell = draw_free_cell(&level, &drawn);
+        snprintf(filename, sizeof(filename), "%d-%d.m", number, g);
+        failed = write_script(filename, options, cell % level.width, cell / level.width, &level, 0, 0);
+    }
+
+    snprintf(filename, sizeof(filename), "%d.lvl", number);
+    FILE *out = failed ? NULL : fopen(filename, "w");
+    if (out) {
+        static const char *pacman_names[] = { "none", "random", "path" };
+        fprintf(out, "# level %d of levelgen --seed %lu --size %dx%d --walls %.2f --ghosts %d --script-length %d "
+                "--charge %.2f --passo %d --tempo %d --pacman %s --pacmans %d\n", number, options->seed,
+                options->width, options->height, options->walls, options->n_ghosts, options->script_length,
+                options->charge, options->passo, options->tempo, pacman_names[options->pacman], options->n_pacmans);
+        fprintf(out, "DIM %d %d\nTEMPO %d\n", level.height, level.width, options->tempo);
+        if (options->pacman != PACMAN_NONE || n_pacmans > 1) {
+            fputs("PAC", out);
+            for (int p = 0; p < n_pacmans; p++) {
+                pacman_file(filename, number, p);
+                fprintf(out, " %s", filename);
+            }
+            fputc('\n', out);
+        }
+        if (n_ghosts > 0) {
+            fputs("MON", out);
+            for (int g = 0; g < n_ghosts; g++) fprintf(out, " %d-%d.m", number, g);
+            fputc('\n', out);
+        }
+        for (int y = 0; y < level.height; y++) {
+            fwrite(&level.cells[y * level.width], 1, level.width, out);
+            fputc('\n', out);
+        }
+        failed = fclose(out) != 0;
+    } else {
+        failed = 1;
+    }
+
+    if (!failed) {
+        printf("%d.lvl: %dx%d, %d reachable cells, %d pacmans, %d ghosts, portal at (%d, %d)\n", number, level.width,
+               level.height, level.n_reached, n_pacmans, n_ghosts, level.portal % level.width,
+               level.portal / level.width);
+    }
+
+    free(level.cells);
+    free(level.from);
+    free(level.reached);
+    return failed;
+}
+
+static int parse_options(int argc, char **argv, gen_options_t *options, const char **out_dir) {
+    *options = (gen_options_t){ .seed = 1, .width = 64, .height = 64, .walls = 0.25, .n_ghosts = 8,
+                                .script_length = 32, .charge = 0.1, .passo = 0, .tempo = 10, .n_levels = 1,
+                                .pacman = PACMAN_NONE, .n_pacmans = 1 };
+    *out_dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (argv[i][0] != '-') {
+            if (*out_dir) return 1;
+            *out_dir = argv[i];
+            continue;
+        }
+        if (!value) return 1;
+        i++;
+
+        if (strcmp(argv[i - 1], "--seed") == 0) options->seed = strtoul(value, NULL, 10);
+        else if (strcmp(argv[i - 1], "--size") == 0) {
+            if (sscanf(value, "%dx%d", &options->width, &options->height) != 2) return 1;
+        }
+        else if (strcmp(argv[i - 1], "--walls") == 0) options->walls = atof(value);
+        else if (strcmp(argv[i - 1], "--ghosts") == 0) options->n_ghosts = atoi(value);
+        else if (strcmp(argv[i - 1], "--pacmans") == 0) options->n_pacmans = atoi(value);
+        else if (strcmp(argv[i - 1], "--script-length") == 0) options->script_length = atoi(value);
+        else if (strcmp(argv[i - 1], "--charge") == 0) options->charge = atof(value);
+        else if (strcmp(argv[i - 1], "--passo") == 0) options->passo = atoi(value);
+        else if (strcmp(argv[i - 1], "--tempo") == 0) options->tempo = atoi(value);
+        else if (strcmp(argv[i - 1], "--levels") == 0) options->n_levels = atoi(value);
+        else if (strcmp(argv[i - 1], "--pacman") == 0) {
+            if (strcmp(value, "none") == 0) options->pacman = PACMAN_NONE;
+            else if (strcmp(value, "random") == 0) options->pacman = PACMAN_RANDOM;
+            else if (strcmp(value, "path") == 0) options->pacman = PACMAN_PATH;
+            else return 1;
+        }
+        else return 1;
+    }
+
+    // The inner cells must leave room for the start and a portal apart from it
+    return !*out_dir || options->width < 4 || options->height < 4 || options->width > 32767 ||
+           options->height > 32767 || options->walls < 0 || options->walls >= 1 || options->n_ghosts < 0 || options->n_pacmans < 1 ||
+           options->script_length < 1 || options->charge < 0 || options->charge > 1 || options->passo < 0 ||
+           options->tempo < 1 || options->n_levels < 1;
+}
+
+int main(int argc, char **argv) {
+    gen_options_t options;
+    const char *out_dir;
+    if (parse_options(argc, argv, &options, &out_dir) != 0) {
+        fprintf(stderr, "Usage: %s <output_directory> [--seed N] [--size WxH] [--walls 0-0.99] [--ghosts N]\n"
+                        "       [--script-length N] [--charge 0-1] [--passo N] [--tempo ms] [--levels N]\n"
+                        "       [--pacman none|random|path] [--pacmans N]\n", argv[0]);
+        return 2;
+    }
+
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating the output directory");
+        return 2;
+    }
+    if (chdir(out_dir) != 0) {
+        perror("Error changing directory");
+        return 2;
+    }
+
+    for (int number = 1; number <= options.n_levels; number++) {
+        if (generate_level(number, &options) != 0) {
+            fprintf(stderr, "Error: could not write level %d\n", number);
+            return 1;
+        }
+    }
+    return 0;
+}
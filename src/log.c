@@ -0,0 +1,284 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RECORD_ALIGN 8
+#define LOG_INLINE_MAX 512                      // messages up to this size are formatted once, on the stack
+#define LOG_MESSAGE_MAX (LOG_RING_BYTES / 4)    // longer messages are cut
+#define LOG_WRAP 0xFFFFFFFFu                    // length marking the rest of the ring as unused
+#define LOG_IDLE_MAX_MS 64                      // longest nap of the writer while nothing is logged
+
+// Header of each record, the text follows and the record is padded to LOG_RECORD_ALIGN
+typedef struct {
+    uint32_t len;   // bytes of text, LOG_WRAP for the filler at the end of the ring
+    uint32_t pad;
+    uint64_t seq;   // position of the message among the messages of every thread
+} log_record_t;
+
+// Byte ring of one thread, written only by that thread and read only by the writer thread
+typedef struct log_ring {
+    char data[LOG_RING_BYTES];
+    uint64_t head;             // bytes consumed, advanced by the writer
+    uint64_t tail;             // bytes produced, advanced by the owner
+    unsigned long dropped;     // messages the owner could not queue
+    unsigned long reported;    // drops the writer already wrote about
+    int closed;                // the owner exited, the ring is freed once drained
+    struct log_ring* next;     // next ring in the registry
+} log_ring_t;
+
+static struct {
+    FILE* file;                // the debug file
+    pthread_t writer;          // thread draining every ring into the file
+    int running;               // the writer thread is up and messages are accepted
+    int stopping;              // asks the writer to drain everything and exit
+    pthread_mutex_t mutex;     // protects the registry, only taken once per thread
+    log_ring_t* rings;         // every registered ring
+    uint64_t seq;              // messages numbered so far, the writer merges the rings in this order
+    pthread_key_t key;         // closes a thread's ring when it exits
+    pthread_once_t once;
+} logger = { .mutex = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static _Thread_local log_ring_t* own_ring;
+
+static void close_ring(void* arg) {
+    log_ring_t* ring = (log_ring_t*)arg;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void create_key(void) {
+    pthread_key_create(&logger.key, close_ring);
+}
+
+// Ring of the calling thread, registered the first time the thread logs
+static log_ring_t* thread_ring(void) {
+    if (own_ring) return own_ring;
+
+    log_ring_t* ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) return NULL;
+
+    pthread_once(&logger.once, create_key);
+    pthread_setspecific(logger.key, ring);
+
+    pthread_mutex_lock(&logger.mutex);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.mutex);
+
+    own_ring = ring;
+    return ring;
+}
+
+static size_t record_size(size_t len) {
+    return (sizeof(log_record_t) + len + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1);
+}
+
+// Finds room for a record of 'len' bytes, wrapping to the start of the ring when the end is too short
+// Returns where the text goes, NULL when the ring is full
+static char* reserve(log_ring_t* ring, size_t len) {
+    size_t need = record_size(len);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t pos = ring->tail & (LOG_RING_BYTES - 1);
+    size_t skip = (LOG_RING_BYTES - pos < need) ? LOG_RING_BYTES - pos : 0;
+
+    if (ring->tail + skip + need - head > LOG_RING_BYTES) return NULL;
+
+    if (skip) {
+        ((log_record_t*)(ring->data + pos))->len = LOG_WRAP;
+        ring->tail += skip;
+        pos = 0;
+    }
+    log_record_t* record = (log_record_t*)(ring->data + pos);
+    record->len = (uint32_t)len;
+    record->seq = __atomic_fetch_add(&logger.seq, 1, __ATOMIC_RELAXED);
+    return ring->data + pos + sizeof(log_record_t);
+}
+
+// Hands a reserved record of 'len' bytes to the writer
+static void commit(log_ring_t* ring, size_t len) {
+    __atomic_store_n(&ring->tail, ring->tail + record_size(len), __ATOMIC_RELEASE);
+}
+
+// Copies a message into the ring, or counts it as dropped when there is no room
+static void queue_message(log_ring_t* ring, const char* text, size_t len) {
+    char* slot = reserve(ring, len);
+    if (!slot) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(slot, text, len);
+    commit(ring, len);
+}
+
+void log_append(const char* text, size_t len, int wait) {
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) return;
+    log_ring_t* ring = thread_ring();
+    if (!ring) return;
+    if (len > LOG_MESSAGE_MAX) len = LOG_MESSAGE_MAX;
+
+    if (!wait) {
+        queue_message(ring, text, len);
+        return;
+    }
+
+    char* slot;
+    while ((slot = reserve(ring, len)) == NULL) {
+        struct timespec nap = { 0, 1000000 };
+        nanosleep(&nap, NULL);
+    }
+    memcpy(slot, text, len);
+    commit(ring, len);
+}
+
+void log_write(int level, const char* format, ...) {
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) return;
+    log_ring_t* ring = thread_ring();
+    if (!ring) return;
+
+    const char* prefix = (level == LOG_ERROR) ? "Error: " : (level == LOG_WARN) ? "Warning: " : "";
+    size_t prefix_len = strlen(prefix);
+    char text[LOG_INLINE_MAX];
+    memcpy(text, prefix, prefix_len);
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text + prefix_len, sizeof(text) - prefix_len, format, args);
+    va_end(args);
+    if (n < 0) return;
+
+    size_t len = prefix_len + (size_t)n;
+    if (len < sizeof(text)) {
+        queue_message(ring, text, len);
+        return;
+    }
+
+    // Too long for the stack buffer, formatted again on the heap
+    if (len > LOG_MESSAGE_MAX) len = LOG_MESSAGE_MAX;
+    char* long_text = malloc(len + 1);
+    if (!long_text) return;
+    memcpy(long_text, prefix, prefix_len);
+    va_start(args, format);
+    vsnprintf(long_text + prefix_len, len + 1 - prefix_len, format, args);
+    va_end(args);
+    queue_message(ring, long_text, len);
+    free(long_text);
+}
+
+// Next record of a ring up to 'tail', skipping the filler before a wrap, NULL when there is none
+static log_record_t* next_record(log_ring_t* ring, uint64_t tail) {
+    while (ring->head != tail) {
+        size_t pos = ring->head & (LOG_RING_BYTES - 1);
+        log_record_t* record = (log_record_t*)(ring->data + pos);
+        if (record->len != LOG_WRAP) return record;
+        __atomic_store_n(&ring->head, ring->head + LOG_RING_BYTES - pos, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Notes in the file how many messages a ring lost since the last note
+static int report_drops(log_ring_t* ring) {
+    unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped == ring->reported) return 0;
+
+    fprintf(logger.file, "Warning: %lu log messages dropped, the log ring was full\n", dropped - ring->reported);
+    ring->reported = dropped;
+    return 1;
+}
+
+// Writes out every queued message, oldest first across all the rings, and frees the rings of exited threads
+// Returns the number of records written
+static int drain_all(void) {
+    int written = 0;
+    int n_rings = 0;
+
+    pthread_mutex_lock(&logger.mutex);
+    for (log_ring_t* ring = logger.rings; ring; ring = ring->next) n_rings++;
+
+    // Only what was queued when the drain started, so a busy thread can not keep the writer here
+    uint64_t tails[n_rings > 0 ? n_rings : 1];
+    int r = 0;
+    for (log_ring_t* ring = logger.rings; ring; ring = ring->next) {
+        tails[r++] = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+
+    while (1) {
+        log_ring_t* oldest = NULL;
+        log_record_t* oldest_record = NULL;
+        r = 0;
+        for (log_ring_t* ring = logger.rings; ring; ring = ring->next, r++) {
+            log_record_t* record = next_record(ring, tails[r]);
+            if (record && (!oldest_record || record->seq < oldest_record->seq)) {
+                oldest = ring;
+                oldest_record = record;
+            }
+        }
+        if (!oldest) break;
+
+        fwrite((char*)oldest_record + sizeof(log_record_t), 1, oldest_record->len, logger.file);
+        __atomic_store_n(&oldest->head, oldest->head + record_size(oldest_record->len), __ATOMIC_RELEASE);
+        written++;
+    }
+
+    log_ring_t** link = &logger.rings;
+    while (*link) {
+        log_ring_t* ring = *link;
+        written += report_drops(ring);
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) && ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&logger.mutex);
+
+    if (written) fflush(logger.file);
+    return written;
+}
+
+// Writer Thread: drains the rings, napping a little longer each time it finds nothing to write
+static void* writer_thread(void* arg) {
+    (void)arg;
+    long nap_ms = 1;
+
+    while (!__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE)) {
+        if (drain_all() > 0) {
+            nap_ms = 1;
+            continue;
+        }
+        struct timespec nap = { 0, nap_ms * 1000000 };
+        nanosleep(&nap, NULL);
+        if (nap_ms < LOG_IDLE_MAX_MS) nap_ms *= 2;
+    }
+    drain_all();
+
+    return NULL;
+}
+
+void open_debug_file(char *filename) {
+    logger.file = fopen(filename, "w");
+    if (!logger.file) return;
+
+    logger.stopping = 0;
+    if (pthread_create(&logger.writer, NULL, writer_thread, NULL) != 0) {
+        fclose(logger.file);
+        logger.file = NULL;
+        return;
+    }
+    __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+}
+
+void close_debug_file() {
+    if (!logger.file) return;
+
+    __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.writer, NULL);
+
+    fclose(logger.file);
+    logger.file = NULL;
+}
@@ -0,0 +1,313 @@
+#include "metrics.h"
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if METRICS
+
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define METRICS_NAME_MAX 32
+
+static const char *histogram_names[N_HISTOGRAMS] = { "move_pacman", "move_ghost", "lock_wait", "state_mutex_hold", "frame",
+                                                     "input_latency" };
+static const char *counter_names[N_COUNTERS] = { "moves", "lock_pairs", "lock_pairs_contended", "frames" };
+
+// Log-linear histogram: exact below HIST_SUB, then HIST_SUB buckets for every power of two
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;     // values recorded
+    uint64_t sum;       // sum of the values, for the mean
+    uint64_t min, max;
+} histogram_t;
+
+// Counters and histograms of one thread, written only by that thread and read by the dumper
+typedef struct metrics_block {
+    char name[METRICS_NAME_MAX];
+    uint64_t counters[N_COUNTERS];
+    histogram_t *histograms[N_HISTOGRAMS];  // allocated the first time the thread records into each one
+    struct metrics_block *next;
+} metrics_block_t;
+
+static struct {
+    pthread_mutex_t mutex;       // protects the registry, only taken once per thread and by the dumper
+    metrics_block_t *blocks;     // every registered block, never freed while the program runs
+    int n_blocks;                // blocks registered so far
+    char filename[PATH_MAX];     // stats file
+    pthread_t dumper;            // thread waiting for SIGUSR1
+    int running;                 // the dumper thread is up
+    int stopping;                // the next SIGUSR1 is the final dump
+    uint64_t started;            // metrics_now() when metrics_start ran
+    unsigned long dumps;         // stats files written
+} metrics = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local metrics_block_t *own_block;
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Block of the calling thread, registered the first time the thread records anything
+static metrics_block_t *thread_block(void) {
+    if (own_block) return own_block;
+
+    metrics_block_t *block = calloc(1, sizeof(metrics_block_t));
+    if (!block) return NULL;
+
+    pthread_mutex_lock(&metrics.mutex);
+    snprintf(block->name, sizeof(block->name), "thread %d", metrics.n_blocks++);
+    block->next = metrics.blocks;
+    metrics.blocks = block;
+    pthread_mutex_unlock(&metrics.mutex);
+
+    own_block = block;
+    return block;
+}
+
+void metrics_name_thread(const char *name) {
+    metrics_block_t *block = thread_block();
+    if (!block) return;
+
+    pthread_mutex_lock(&metrics.mutex);
+    snprintf(block->name, sizeof(block->name), "%s", name);
+    pthread_mutex_unlock(&metrics.mutex);
+}
+
+static int bucket_of(uint64_t value) {
+    if (value < HIST_SUB) return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+static uint64_t bucket_low(int bucket) {
+    if (bucket < HIST_SUB) return (uint64_t)bucket;
+    int exponent = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (exponent - HIST_SUB_BITS);
+}
+
+static uint64_t bucket_high(int bucket) {
+    if (bucket < HIST_SUB) return (uint64_t)bucket;
+    int exponent = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return bucket_low(bucket) + ((uint64_t)1 << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+// Single writer, so plain increments published with relaxed stores are enough
+#define BUMP(field, by) __atomic_store_n(&(field), (field) + (by), __ATOMIC_RELAXED)
+
+void metrics_record(int histogram, uint64_t ns) {
+    metrics_block_t *block = thread_block();
+    if (!block) return;
+
+    histogram_t *h = block->histograms[histogram];
+    if (!h) {
+        h = calloc(1, sizeof(histogram_t));
+        if (!h) return;
+        h->min = UINT64_MAX;
+        __atomic_store_n(&block->histograms[histogram], h, __ATOMIC_RELEASE);
+    }
+
+    BUMP(h->counts[bucket_of(ns)], 1);
+    BUMP(h->total, 1);
+    BUMP(h->sum, ns);
+    if (ns < h->min) __atomic_store_n(&h->min, ns, __ATOMIC_RELAXED);
+    if (ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+void metrics_count(int counter, uint64_t n) {
+    metrics_block_t *block = thread_block();
+    if (!block) return;
+    BUMP(block->counters[counter], n);
+}
+
+// Adds what a thread recorded so far into 'into', the thread may keep recording meanwhile
+static void merge_histogram(histogram_t *into, const histogram_t *from) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        into->counts[b] += __atomic_load_n(&from->counts[b], __ATOMIC_RELAXED);
+    }
+    into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (min < into->min) into->min = min;
+    if (max > into->max) into->max = max;
+}
+
+// Smallest value at least a fraction 'q' of the recorded values are below, within the bucket precision
+static uint64_t percentile(const histogram_t *h, double q) {
+    uint64_t rank = (uint64_t)(q * h->total + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) return (bucket_high(b) < h->max) ? bucket_high(b) : h->max;
+    }
+    return h->max;
+}
+
+static void write_summary(FILE *out, const histogram_t *h) {
+    // The counts are read while other threads record, so the total is taken from the buckets themselves
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) total += h->counts[b];
+    histogram_t copy = *h;
+    copy.total = total;
+
+    fprintf(out, "\"count\": %llu", (unsigned long long)total);
+    if (total == 0) return;
+    fprintf(out, ", \"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu",
+            (unsigned long long)h->min, (double)h->sum / total, (unsigned long long)percentile(&copy, 0.50),
+            (unsigned long long)percentile(&copy, 0.90), (unsigned long long)percentile(&copy, 0.99),
+            (unsigned long long)percentile(&copy, 0.999), (unsigned long long)h->max);
+}
+
+// Writes every block and the totals over all threads as JSON
+static int write_stats(FILE *out, const char *reason) {
+    histogram_t *totals = calloc(N_HISTOGRAMS, sizeof(histogram_t));
+    if (!totals) return 1;
+    uint64_t counters[N_COUNTERS] = {0};
+    for (int k = 0; k < N_HISTOGRAMS; k++) totals[k].min = UINT64_MAX;
+
+    pthread_mutex_lock(&metrics.mutex);
+
+    fprintf(out, "{\n  \"reason\": \"%s\",\n  \"dump\": %lu,\n  \"uptime_s\": %.3f,\n  \"unit\": \"ns\",\n", reason,
+            metrics.dumps + 1, (metrics_now() - metrics.started) / 1e9);
+
+    fprintf(out, "  \"threads\": [");
+    int first_block = 1;
+    for (metrics_block_t *block = metrics.blocks; block; block = block->next) {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"counters\": {", first_block ? "" : ",", block->name);
+        first_block = 0;
+        for (int c = 0; c < N_COUNTERS; c++) {
+            uint64_t value = __atomic_load_n(&block->counters[c], __ATOMIC_RELAXED);
+            counters[c] += value;
+            fprintf(out, "%s\"%s\": %llu", c ? ", " : "", counter_names[c], (unsigned long long)value);
+        }
+        fprintf(out, "}, \"histograms\": {");
+
+        int first_histogram = 1;
+        for (int k = 0; k < N_HISTOGRAMS; k++) {
+            const histogram_t *h = __atomic_load_n(&block->histograms[k], __ATOMIC_ACQUIRE);
+            if (!h) continue;
+
+            histogram_t *mine = calloc(1, sizeof(histogram_t));
+            if (!mine) continue;
+            mine->min = UINT64_MAX;
+            merge_histogram(mine, h);
+            merge_histogram(&totals[k], h);
+
+            fprintf(out, "%s\"%s\": {", first_histogram ? "" : ", ", histogram_names[k]);
+            write_summary(out, mine);
+            fprintf(out, "}");
+            first_histogram = 0;
+            free(mine);
+        }
+        fprintf(out, "}}");
+    }
+    pthread_mutex_unlock(&metrics.mutex);
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"counters\": {");
+    for (int c = 0; c < N_COUNTERS; c++) {
+        fprintf(out, "%s\"%s\": %llu", c ? ", " : "", counter_names[c], (unsigned long long)counters[c]);
+    }
+    fprintf(out, "},\n");
+
+    // Totals keep their buckets, [lowest value, highest value, count] for each bucket that is not empty
+    fprintf(out, "  \"histograms\": {");
+    for (int k = 0; k < N_HISTOGRAMS; k++) {
+        const histogram_t *h = &totals[k];
+        fprintf(out, "%s\n    \"%s\": {", k ? "," : "", histogram_names[k]);
+        write_summary(out, h);
+        fprintf(out, ", \"buckets\": [");
+        int first_bucket = 1;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (h->counts[b] == 0) continue;
+            fprintf(out, "%s[%llu, %llu, %llu]", first_bucket ? "" : ", ", (unsigned long long)bucket_low(b),
+                    (unsigned long long)bucket_high(b), (unsigned long long)h->counts[b]);
+            first_bucket = 0;
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  }\n}\n");
+
+    free(totals);
+    return ferror(out) ? 1 : 0;
+}
+
+// Replaces the stats file in one step, so a reader never sees half a dump
+static void dump_stats(const char *reason) {
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", metrics.filename);
+
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) return;
+    fchmod(fd, 0644);
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    int failed = write_stats(out, reason);
+    if (fclose(out) != 0) failed = 1;
+
+    if (failed || rename(tmp_path, metrics.filename) != 0) {
+        unlink(tmp_path);
+        return;
+    }
+    metrics.dumps++;
+}
+
+// Dumper Thread: sleeps in sigwait until SIGUSR1, which every other thread keeps blocked
+static void *dumper_thread(void *arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+
+        int stopping = __atomic_load_n(&metrics.stopping, __ATOMIC_ACQUIRE);
+        dump_stats(stopping ? "exit" : "signal");
+        if (stopping) break;
+    }
+
+    return NULL;
+}
+
+int metrics_start(const char *filename) {
+    snprintf(metrics.filename, sizeof(metrics.filename), "%s", filename);
+    metrics.started = metrics_now();
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) return 1;
+
+    metrics.stopping = 0;
+    if (pthread_create(&metrics.dumper, NULL, dumper_thread, NULL) != 0) return 1;
+    metrics.running = 1;
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (!metrics.running) return;
+
+    __atomic_store_n(&metrics.stopping, 1, __ATOMIC_RELEASE);
+    pthread_kill(metrics.dumper, SIGUSR1);
+    pthread_join(metrics.dumper, NULL);
+    metrics.running = 0;
+}
+
+#endif
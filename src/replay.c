@@ -0,0 +1,252 @@
+#include "board.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Outcome of replaying one segment
+typedef struct {
+    unsigned long ticks;        // ticks the segment lasted
+    unsigned long diverged;     // moves that did not play out as recorded
+    int first_mismatch;         // the first of them was already reported
+} replay_state_t;
+
+static const char *result_name(int result) {
+    switch (result) {
+        case REACHED_PORTAL: return "portal";
+        case VALID_MOVE: return "valid";
+        case INVALID_MOVE: return "invalid";
+        case DEAD_PACMAN: return "dead";
+        default: return "?";
+    }
+}
+
+// Reports a move that played out differently from the trace, only the first one of a segment in detail
+static void mismatch(replay_state_t *replay, unsigned long n, const trace_record_t *recorded,
+                     const trace_record_t *replayed, const char *what) {
+    replay->diverged++;
+    if (replay->first_mismatch) return;
+    replay->first_mismatch = 1;
+
+    printf("  diverged at event %lu (tick %lu): %s %d %s, recorded %c/%c %s, replayed %c/%c %s\n", n,
+           replay->ticks, recorded->kind == TRACE_PACMAN ? "pacman" : "ghost", recorded->index, what,
+           recorded->command ? recorded->command : '-', recorded->played ? recorded->played : '-',
+           result_name(recorded->result), replayed->command ? replayed->command : '-',
+           replayed->played ? replayed->played : '-', result_name(replayed->result));
+}
+
+// Plays one recorded move on the board and checks it did what the trace says
+static void replay_move(board_t *board, trace_t *scratch, replay_state_t *replay, unsigned long n,
+                        const trace_record_t *recorded) {
+    int is_pacman = recorded->kind == TRACE_PACMAN;
+    int count = is_pacman ? board->n_pacmans : board->n_ghosts;
+    if (recorded->index < 0 || recorded->index >= count) {
+        trace_record_t none = {0};
+        mismatch(replay, n, recorded, &none, "does not exist");
+        return;
+    }
+
+    // A scripted entity plays its own program, the program counter must point at the recorded instruction
+    const program_t *program = is_pacman ? board->pacmans[recorded->index].program
+                                         : board->ghosts[recorded->index].program;
+    int current_move = is_pacman ? board->pacmans[recorded->index].current_move
+                                 : board->ghosts[recorded->index].current_move;
+    command_t command = { .command = recorded->command, .turns = 1 };
+    if (program && program->n_ops > 0) command = program->ops[current_move];
+
+    int alive_before = pacmans_alive(board);
+
+    // The live game hands each wait to the scheduler instead of counting it down, a recorded move
+    // was only played once the entity had slept through all of it
+    if (is_pacman) {
+        board->pacmans[recorded->index].waiting = 0;
+    } else {
+        board->ghosts[recorded->index].waiting = 0;
+    }
+    int result = is_pacman ? move_pacman(board, recorded->index, &command)
+                           : move_ghost(board, recorded->index, &command);
+
+    trace_record_t replayed = { recorded->kind, command.command, 0, (int8_t)result, recorded->index };
+    trace_record_t taken;
+    if (trace_take(scratch, recorded->kind, recorded->index, &taken) == 0) replayed.played = taken.played;
+
+    if (replayed.command != recorded->command) {
+        mismatch(replay, n, recorded, &replayed, "was given another command");
+    } else if (replayed.played != recorded->played) {
+        mismatch(replay, n, recorded, &replayed, "drew another direction");
+    } else if (replayed.result != recorded->result) {
+        mismatch(replay, n, recorded, &replayed, "got another result");
+    }
+
+    // Deaths are what traces are usually replayed for, say where each one happened
+    // A ghost kills the pacman standing on the cell it moved to
+    if (pacmans_alive(board) < alive_before) {
+        const pacman_t *pac = &board->pacmans[is_pacman ? recorded->index : 0];
+        for (int p = 0; p < board->n_pacmans && !is_pacman; p++) {
+            const pacman_t *dead = &board->pacmans[p];
+            if (!dead->alive && dead->pos_x == board->ghosts[recorded->index].pos_x &&
+                dead->pos_y == board->ghosts[recorded->index].pos_y) {
+                pac = dead;
+            }
+        }
+        if (is_pacman) {
+            printf("  tick %lu: pacman %d walked into a ghost at (%d, %d)\n", replay->ticks, recorded->index,
+                   pac->pos_x, pac->pos_y);
+        } else {
+            const ghost_t *ghost = &board->ghosts[recorded->index];
+            printf("  tick %lu: ghost %d caught pacman %d at (%d, %d)\n", replay->ticks, recorded->index,
+                   (int)(pac - board->pacmans), ghost->pos_x, ghost->pos_y);
+        }
+    }
+}
+
+// Compares the replayed board with the board the segment ended with, returns the number of differences
+static int compare_board(const board_t *board, const checkpoint_t *end) {
+    int differences = 0;
+    int n_cells = board->width * board->height;
+
+    for (int i = 0; i < n_cells; i++) {
+        const board_pos_t *got = &board->board[i];
+        const board_pos_t *want = &end->cells[i];
+        if (got->content != want->content || got->has_dot != want->has_dot || got->has_portal != want->has_portal) {
+            if (differences == 0) {
+                printf("  final board differs at (%d, %d): replayed '%c'%s, recorded '%c'%s\n", i % board->width,
+                       i / board->width, got->content, got->has_dot ? " with a dot" : "", want->content,
+                       want->has_dot ? " with a dot" : "");
+            }
+            differences++;
+        }
+    }
+
+    for (int p = 0; p < board->n_pacmans; p++) {
+        const pacman_t *got = &board->pacmans[p];
+        const pacman_t *want = &end->pacmans[p];
+        if (got->pos_x != want->pos_x || got->pos_y != want->pos_y || got->alive != want->alive ||
+            got->points != want->points || got->current_move != want->current_move ||
+            got->current_repeat != want->current_repeat || got->rng != want->rng) {
+            if (differences == 0) {
+                printf("  pacman %d ended at (%d, %d) with %d points on instruction %d, recorded (%d, %d) with %d points "
+                       "on instruction %d%s\n", p, got->pos_x, got->pos_y, got->points, got->current_move,
+                       want->pos_x, want->pos_y, want->points, want->current_move,
+                       got->rng != want->rng ? ", random draws differ" : "");
+            }
+            differences++;
+        }
+    }
+
+    for (int g = 0; g < board->n_ghosts; g++) {
+        const ghost_t *got = &board->ghosts[g];
+        const ghost_t *want = &end->ghosts[g];
+        if (got->pos_x != want->pos_x || got->pos_y != want->pos_y || got->charged != want->charged ||
+            got->current_move != want->current_move || got->current_repeat != want->current_repeat ||
+            got->rng != want->rng) {
+            if (differences == 0) {
+                printf("  ghost %d ended at (%d, %d) on instruction %d, recorded (%d, %d) on instruction %d%s\n", g,
+                       got->pos_x, got->pos_y, got->current_move, want->pos_x, want->pos_y, want->current_move,
+                       got->rng != want->rng ? ", random draws differ" : "");
+            }
+            differences++;
+        }
+    }
+
+    return differences;
+}
+
+// Loads the segment's level, puts it in the state the segment started from and plays every recorded move
+// Returns 0 when every move and the final board match the trace
+static int replay_segment(const trace_segment_t *segment, int lockfree, unsigned long number) {
+    board_t board = {0};
+    if (load_level_filename(&board, segment->level_name, 0) != 0) {
+        printf("segment %lu: cannot load level %s\n", number, segment->level_name);
+        return 1;
+    }
+    strncpy(board.level_name, segment->level_name, 255);
+    if (lockfree) enable_lockfree_moves(&board);
+
+    checkpoint_t start = segment->start;
+    if (checkpoint_restore(&start, &board) != 0) {
+        printf("segment %lu: level %s no longer matches the trace\n", number, segment->level_name);
+        unload_level(&board);
+        return 1;
+    }
+
+    trace_t scratch = {0};
+    trace_begin(&scratch, &board, segment->level);
+
+    replay_state_t replay = {0};
+    struct timespec begin, finish;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (uint64_t e = 0; e < segment->n_records; e++) {
+        const trace_record_t *record = &segment->records[e];
+        if (record->kind == TRACE_TICK) {
+            replay.ticks++;
+        } else {
+            replay_move(&board, &scratch, &replay, (unsigned long)e, record);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double seconds = (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9;
+    trace_end(&scratch, &board);
+
+    int differences = compare_board(&board, &segment->end);
+    printf("segment %lu: %-16s events=%-9llu ticks=%-8lu %.3f ms (%.0f events/s) %s\n", number,
+           segment->level_name, (unsigned long long)segment->n_records, replay.ticks, seconds * 1e3,
+           seconds > 0 ? segment->n_records / seconds : 0.0,
+           (replay.diverged == 0 && differences == 0) ? "match" : "MISMATCH");
+    if (replay.diverged > 0) printf("  %lu move(s) diverged from the trace\n", replay.diverged);
+    if (differences > 0) printf("  %d difference(s) in the final board\n", differences);
+
+    unload_level(&board);
+    return (replay.diverged == 0 && differences == 0) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <trace_file> [level_directory]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror("Error opening trace");
+        return 2;
+    }
+
+    trace_header_t header;
+    if (trace_read_header(in, &header) != 0) {
+        fprintf(stderr, "Error: %s is not a trace this build can read\n", argv[1]);
+        fclose(in);
+        return 2;
+    }
+
+    const char *level_dir = (argc == 3) ? argv[2] : header.level_dir;
+    if (chdir(level_dir) != 0) {
+        perror("Error changing directory");
+        fclose(in);
+        return 2;
+    }
+
+    printf("Replaying %s from %s%s\n", argv[1], level_dir, header.lockfree ? ", lock-free moves" : "");
+
+    int failed = 0;
+    unsigned long number = 0;
+    trace_segment_t segment;
+    int status;
+
+    while ((status = trace_read_segment(in, &segment)) == 0) {
+        failed |= replay_segment(&segment, header.lockfree, ++number);
+        trace_free_segment(&segment);
+    }
+    if (status < 0) {
+        printf("segment %lu: trace ends in the middle of it, the session did not finish writing\n", number + 1);
+    }
+    fclose(in);
+
+    printf("%lu segment(s) replayed, %s\n", number, failed ? "the trace does NOT reproduce" : "the trace reproduces");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+#include "scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Monotonic time at which tick 'tick' starts
+static struct timespec tick_deadline(const scheduler_t* sched, unsigned long tick) {
+    unsigned long long ms = (unsigned long long)tick * sched->tempo;
+    struct timespec deadline = sched->epoch;
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+static int deadline_passed(const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != deadline->tv_sec) return now.tv_sec > deadline->tv_sec;
+    return now.tv_nsec >= deadline->tv_nsec;
+}
+
+// Tick the clock is in, never behind the last tick the timer fired
+// A sleeper that stayed off the wheel for a while would otherwise be due in the past and wake at once
+static unsigned long current_tick(const scheduler_t* sched) {
+    if (sched->tempo <= 0) return sched->now;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (now.tv_sec - sched->epoch.tv_sec) * 1000LL + (now.tv_nsec - sched->epoch.tv_nsec) / 1000000;
+    unsigned long tick = (ms > 0) ? (unsigned long)(ms / sched->tempo) : 0;
+    return (tick > sched->now) ? tick : sched->now;
+}
+
+// Earliest tick with an entry in the wheel, which must not be empty
+// Looks one turn ahead first, entries further away are only found by the slower full walk
+static unsigned long next_due(const scheduler_t* sched) {
+    for (unsigned long tick = sched->now + 1; tick <= sched->now + SCHED_WHEEL_SLOTS; tick++) {
+        for (sched_entry_t* e = sched->slots[tick % SCHED_WHEEL_SLOTS]; e; e = e->next) {
+            if (e->due == tick) return tick;
+        }
+    }
+
+    unsigned long earliest = 0;
+    for (int s = 0; s < SCHED_WHEEL_SLOTS; s++) {
+        for (sched_entry_t* e = sched->slots[s]; e; e = e->next) {
+            if (earliest == 0 || e->due < earliest) earliest = e->due;
+        }
+    }
+    return earliest;
+}
+
+// Wakes every entry of the slot of 'tick' that is due at it, the rest wait for a later round
+// Must be called with sched->mutex held
+static void fire_tick(scheduler_t* sched, unsigned long tick) {
+    sched_entry_t** link = &sched->slots[tick % SCHED_WHEEL_SLOTS];
+
+    while (*link) {
+        sched_entry_t* e = *link;
+        if (e->due != tick) {
+            link = &e->next;
+            continue;
+        }
+        *link = e->next;
+        e->next = NULL;
+        e->fired = 1;
+        sched->n_scheduled--;
+        pthread_cond_signal(&e->cond);
+    }
+}
+
+// Timer Thread: sleeps until the next tick that has something due, with no deadline while the wheel is empty
+static void* timer_thread(void* arg) {
+    scheduler_t* sched = (scheduler_t*)arg;
+
+    pthread_mutex_lock(&sched->mutex);
+    while (!sched->stopped) {
+        if (sched->n_scheduled == 0) {
+            sched->target = 0;
+            pthread_cond_wait(&sched->timer_cond, &sched->mutex);
+            continue;
+        }
+
+        unsigned long due = next_due(sched);
+        struct timespec deadline = tick_deadline(sched, due);
+        if (!deadline_passed(&deadline)) {
+            sched->target = due;
+            pthread_cond_timedwait(&sched->timer_cond, &sched->mutex, &deadline);
+            continue;
+        }
+
+        sched->now = due;
+        fire_tick(sched, due);
+    }
+    pthread_mutex_unlock(&sched->mutex);
+
+    return NULL;
+}
+
+void sched_init(scheduler_t* sched, int tempo, int n_entries) {
+    memset(sched, 0, sizeof(*sched));
+    sched->tempo = tempo;
+    sched->n_entries = n_entries;
+    sched->entries = calloc(n_entries, sizeof(sched_entry_t));
+
+    // Both the sleepers and the timer measure time on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->timer_cond, &attr);
+    for (int i = 0; i < n_entries; i++) {
+        pthread_cond_init(&sched->entries[i].cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_init(&sched->mutex, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &sched->epoch);
+    pthread_create(&sched->tid, NULL, timer_thread, sched);
+}
+
+// Hashes the entry into the wheel and blocks on its own condition until the timer thread fires it
+int sched_sleep(scheduler_t* sched, int entry, long plays, long* left) {
+    sched_entry_t* e = &sched->entries[entry];
+    long remaining = (plays > 0) ? plays : 0;
+
+    pthread_mutex_lock(&sched->mutex);
+    if (plays > 0 && !sched->stopped) {
+        e->due = current_tick(sched) + plays;
+        e->fired = 0;
+        e->next = sched->slots[e->due % SCHED_WHEEL_SLOTS];
+        sched->slots[e->due % SCHED_WHEEL_SLOTS] = e;
+        sched->n_scheduled++;
+
+        // Only an entry due before the tick the timer already waits for needs to wake it
+        if (sched->target == 0 || e->due < sched->target) {
+            pthread_cond_signal(&sched->timer_cond);
+        }
+
+        while (!e->fired && !sched->stopped) {
+            pthread_cond_wait(&e->cond, &sched->mutex);
+        }
+
+        // A stopped sleeper keeps the plays it had not slept through yet, the entry stays in the wheel until destroy
+        unsigned long tick = current_tick(sched);
+        remaining = (e->fired || e->due <= tick) ? 0 : (long)(e->due - tick);
+    }
+    int stopped = sched->stopped;
+    pthread_mutex_unlock(&sched->mutex);
+
+    if (left) *left = stopped ? remaining : 0;
+    return stopped;
+}
+
+void sched_stop(scheduler_t* sched) {
+    pthread_mutex_lock(&sched->mutex);
+    sched->stopped = 1;
+    pthread_cond_signal(&sched->timer_cond);
+    for (int i = 0; i < sched->n_entries; i++) {
+        pthread_cond_signal(&sched->entries[i].cond);
+    }
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+void sched_destroy(scheduler_t* sched) {
+    sched_stop(sched);
+    pthread_join(sched->tid, NULL);
+
+    for (int i = 0; i < sched->n_entries; i++) {
+        pthread_cond_destroy(&sched->entries[i].cond);
+    }
+    free(sched->entries);
+    pthread_cond_destroy(&sched->timer_cond);
+    pthread_mutex_destroy(&sched->mutex);
+}
@@ -0,0 +1,197 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "PACTRC1"
+#define TRACE_VERSION 1
+#define SEGMENT_MAGIC "SEGM"
+#define LANE_FIRST_EVENTS 256
+
+// Marks the start of a segment, followed by the board it starts from
+typedef struct {
+    char magic[4];      // SEGMENT_MAGIC
+    int32_t level;      // position of the level in the level list
+} segment_header_t;
+
+int trace_open(trace_t* trace, const char* filename, const char* level_dir, int lockfree) {
+    memset(trace, 0, sizeof(*trace));
+    trace->file = fopen(filename, "wb");
+    if (!trace->file) return 1;
+
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.lockfree = lockfree;
+    snprintf(header.level_dir, sizeof(header.level_dir), "%s", level_dir);
+
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1 || fflush(trace->file) != 0) {
+        fclose(trace->file);
+        trace->file = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+int trace_begin(trace_t* trace, board_t* board, int level) {
+    trace->n_pacmans = board->n_pacmans;
+    trace->level = level;
+    trace->n_lanes = 1 + board->n_pacmans + board->n_ghosts;
+    trace->lanes = calloc(trace->n_lanes, sizeof(trace_lane_t));
+    board->trace = trace;
+
+    if (!trace->file) return 0;
+
+    segment_header_t header = { SEGMENT_MAGIC, level };
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) return 1;
+    return checkpoint_write_stream(board, level, trace->file);
+}
+
+uint64_t trace_order(trace_t* trace) {
+    return __atomic_fetch_add(&trace->order, 1, __ATOMIC_RELAXED);
+}
+
+// Lane of an entity, NULL for an index the segment does not have
+static trace_lane_t* lane_of(trace_t* trace, int kind, int index) {
+    int lane = 0;
+    if (kind == TRACE_PACMAN) lane = 1 + index;
+    else if (kind == TRACE_GHOST) lane = 1 + trace->n_pacmans + index;
+
+    if (index < 0 || lane >= trace->n_lanes) return NULL;
+    return &trace->lanes[lane];
+}
+
+// Appends an event to a lane, doubling it when full
+static void lane_append(trace_lane_t* lane, uint64_t order, const trace_record_t* record) {
+    if (lane->n_events == lane->capacity) {
+        size_t capacity = lane->capacity ? lane->capacity * 2 : LANE_FIRST_EVENTS;
+        trace_event_t* events = realloc(lane->events, capacity * sizeof(trace_event_t));
+        if (!events) return;
+        lane->events = events;
+        lane->capacity = capacity;
+    }
+    lane->events[lane->n_events++] = (trace_event_t){ order, *record };
+}
+
+void trace_move(trace_t* trace, uint64_t order, int kind, int index, char command, char played, int result) {
+    trace_lane_t* lane = lane_of(trace, kind, index);
+    if (!lane) return;
+
+    trace_record_t record = { (uint8_t)kind, command, played, (int8_t)result, index };
+    lane_append(lane, order, &record);
+}
+
+void trace_tick(trace_t* trace) {
+    trace_record_t record = { TRACE_TICK, 0, 0, 0, 0 };
+    lane_append(&trace->lanes[0], trace_order(trace), &record);
+}
+
+int trace_take(trace_t* trace, int kind, int index, trace_record_t* record) {
+    trace_lane_t* lane = lane_of(trace, kind, index);
+    if (!lane || lane->n_events == 0) return 1;
+
+    *record = lane->events[--lane->n_events].record;
+    return 0;
+}
+
+static int compare_events(const void* a, const void* b) {
+    uint64_t order_a = ((const trace_event_t*)a)->order;
+    uint64_t order_b = ((const trace_event_t*)b)->order;
+    return (order_a > order_b) - (order_a < order_b);
+}
+
+// Writes the events of every lane as one sequence sorted by order number
+static int write_events(trace_t* trace) {
+    uint64_t n_events = 0;
+    for (int l = 0; l < trace->n_lanes; l++) {
+        n_events += trace->lanes[l].n_events;
+    }
+
+    trace_event_t* events = malloc((n_events ? n_events : 1) * sizeof(trace_event_t));
+    if (!events) return 1;
+    size_t n = 0;
+    for (int l = 0; l < trace->n_lanes; l++) {
+        memcpy(&events[n], trace->lanes[l].events, trace->lanes[l].n_events * sizeof(trace_event_t));
+        n += trace->lanes[l].n_events;
+    }
+    qsort(events, n, sizeof(trace_event_t), compare_events);
+
+    int ok = fwrite(&n_events, sizeof(n_events), 1, trace->file) == 1;
+    for (size_t e = 0; e < n && ok; e++) {
+        ok = fwrite(&events[e].record, sizeof(trace_record_t), 1, trace->file) == 1;
+    }
+    free(events);
+
+    trace->events += n_events;
+    return ok ? 0 : 1;
+}
+
+int trace_end(trace_t* trace, board_t* board) {
+    board->trace = NULL;
+    int failed = 0;
+
+    if (trace->file) {
+        failed = write_events(trace);
+        if (!failed) failed = checkpoint_write_stream(board, trace->level, trace->file);
+        if (fflush(trace->file) != 0) failed = 1;
+        trace->segments++;
+    }
+
+    for (int l = 0; l < trace->n_lanes; l++) {
+        free(trace->lanes[l].events);
+    }
+    free(trace->lanes);
+    trace->lanes = NULL;
+    trace->n_lanes = 0;
+    return failed;
+}
+
+void trace_close(trace_t* trace) {
+    if (trace->file) fclose(trace->file);
+    trace->file = NULL;
+}
+
+int trace_read_header(FILE* in, trace_header_t* header) {
+    if (fread(header, sizeof(*header), 1, in) != 1 ||
+        memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRACE_VERSION || header->record_size != sizeof(trace_record_t)) {
+        return 1;
+    }
+    header->level_dir[sizeof(header->level_dir) - 1] = '\0';
+    return 0;
+}
+
+int trace_read_segment(FILE* in, trace_segment_t* segment) {
+    memset(segment, 0, sizeof(*segment));
+
+    segment_header_t header;
+    size_t got = fread(&header, 1, sizeof(header), in);
+    if (got == 0 && feof(in)) return 1;
+    if (got != sizeof(header) || memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) != 0) return -1;
+    segment->level = header.level;
+
+    char end_name[MAX_FILENAME];
+    if (checkpoint_read_stream(&segment->start, in, segment->level_name) != 0) return -1;
+
+    if (fread(&segment->n_records, sizeof(segment->n_records), 1, in) != 1 ||
+        segment->n_records > SIZE_MAX / sizeof(trace_record_t)) {
+        trace_free_segment(segment);
+        return -1;
+    }
+    segment->records = malloc((segment->n_records ? segment->n_records : 1) * sizeof(trace_record_t));
+    if (!segment->records ||
+        fread(segment->records, sizeof(trace_record_t), segment->n_records, in) != segment->n_records ||
+        checkpoint_read_stream(&segment->end, in, end_name) != 0) {
+        trace_free_segment(segment);
+        return -1;
+    }
+    return 0;
+}
+
+void trace_free_segment(trace_segment_t* segment) {
+    checkpoint_free(&segment->start, NULL);
+    checkpoint_free(&segment->end, NULL);
+    free(segment->records);
+    memset(segment, 0, sizeof(*segment));
+}